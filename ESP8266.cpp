@@ -23,21 +23,31 @@
 #include <string.h>
 
 
-int PIN_RTS = 19;
-uint8_t tmpBufIndex;
-char  tmpBuf[32];
-connection_t GConnects[MAX_MUX];
 
-#define LOG_OUTPUT_DEBUG            (0)
-#define LOG_OUTPUT_DEBUG_PREFIX     (0)
+/* Receive ring of the Teensy 3.x core before attachRxBuffer, SERIAL2_RX_BUFFER_SIZE */
+#ifndef RX_CORE_BUFFER
+#define RX_CORE_BUFFER 64
+#endif
+
+#define TX_CHUNK_LEN ESP8266_TX_CHUNK_LEN
+#define TX_CHUNK_MAX ESP8266_TX_CHUNK_MAX   /* CIPSEND allows 2048 from AT 1.0 */
 
-#define logDebug(arg)\
+#define LOG_LEVEL_ERROR             (1)
+#define LOG_LEVEL_WARN              (2)
+#define LOG_LEVEL_INFO              (3)
+#define LOG_LEVEL_DEBUG             (4)
+
+/*
+ * The level is a constant, so a filtered out diagnostic is dead code and
+ * neither its format string nor its arguments end up in the build.
+ */
+#define logLevel(level, ...)\
     do {\
-        if (LOG_OUTPUT_DEBUG)\
+        if (ESP8266_LOG_LEVEL >= (level))\
         {\
-            if (LOG_OUTPUT_DEBUG_PREFIX)\
+            if (ESP8266_LOG_PREFIX)\
             {\
-                Console.print("[LOG Debug: ");\
+                Console.print("[");\
                 Console.print((const char*)__FILE__);\
                 Console.print(",");\
                 Console.print((unsigned int)__LINE__);\
@@ -45,25 +55,71 @@ connection_t GConnects[MAX_MUX];
                 Console.print((const char*)__FUNCTION__);\
                 Console.print("] ");\
             }\
-            Console.print(arg);\
+            Console.printf(__VA_ARGS__);\
         }\
     } while(0)
 
+#define logError(...)   logLevel(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define logWarn(...)    logLevel(LOG_LEVEL_WARN, __VA_ARGS__)
+#define logInfo(...)    logLevel(LOG_LEVEL_INFO, __VA_ARGS__)
+#define logDebug(...)   logLevel(LOG_LEVEL_DEBUG, __VA_ARGS__)
+
 #ifdef ESP8266_USE_SOFTWARE_SERIAL
-ESP8266::ESP8266(SoftwareSerial &uart, uint32_t baud): m_puart(&uart)
+ESP8266::ESP8266(SoftwareSerial &uart, uint32_t baud): m_puart(&uart), m_rts_pin(-1), m_cts_pin(-1)
 {
     m_puart->begin(baud);
     rx_empty();
+    init(baud);
 }
 #else
-ESP8266::ESP8266(HardwareSerial &uart, uint32_t baud): m_puart(&uart)
+ESP8266::ESP8266(HardwareSerial &uart, uint32_t baud, int8_t rts_pin, int8_t cts_pin):
+    m_puart(&uart), m_rts_pin(rts_pin), m_cts_pin(cts_pin)
 {
     m_puart->begin(baud);
     rx_empty();
-    memset(&ctx_tx,  0, sizeof(ctx_tx));
+    init(baud);
 }
 #endif
 
+/* Bits of ESP8266Timer::poll() */
+#define TIMER_RX 0
+#define TIMER_TX 1
+
+void ESP8266::init(uint32_t baud)
+{
+    memset(&m_rx_timer, 0, sizeof(m_rx_timer));
+    memset(&m_tx_timer, 0, sizeof(m_tx_timer));
+    m_rx_timer.id = TIMER_RX;
+    m_tx_timer.id = TIMER_TX;
+    memset(&m_ctx_tx,  0, sizeof(m_ctx_tx));
+    memset(m_connects, 0, sizeof(m_connects));
+    m_ready = 0;
+    memset(m_ctx.buf, 0, sizeof(m_ctx.buf));
+    reset_rx_ctx();
+    m_ctx.rx_event = 0;
+    m_rx_capacity = 0;
+    memset(&m_counters, 0, sizeof(m_counters));
+    memset(m_latency, 0, sizeof(m_latency));
+    memset(m_rx_since, 0, sizeof(m_rx_since));
+    m_capture = NULL;
+    m_trace_head = 0;
+    m_trace_frozen = 0;
+    m_trace_on_fault = false;
+
+    m_bringup = BRINGUP_IDLE;
+    m_bringup_time = 0;
+    m_pump_run = false;
+    m_pump_id = -1;
+    m_pump_idle_sleep = 1;
+    m_caps = 0;
+    m_at_version = 0;
+    m_tx_chunk = TX_CHUNK_LEN;
+    m_baud = baud;
+    m_flow = 0;
+    m_baud_errors = 0;
+    m_baud_fallbacks = 0;
+}
+
 bool ESP8266::kick(void)
 {
     return eAT();
@@ -71,19 +127,24 @@ bool ESP8266::kick(void)
 
 bool ESP8266::restart(void)
 {
-    pinMode(PIN_RTS, OUTPUT);
-    Serial2.attachRts(PIN_RTS);
+#ifndef ESP8266_USE_SOFTWARE_SERIAL
+    if (m_rts_pin >= 0) {
+        pinMode(m_rts_pin, OUTPUT);
+        m_puart->attachRts(m_rts_pin);
+    }
+#endif
 
-    for (int i =0; i < 5; i++) {
-        memset(&(GConnects[i]),  0, sizeof(connection_t));
+    for (int i =0; i < MAX_MUX; i++) {
+        memset(&(m_connects[i]),  0, sizeof(connection_t));
     }
+    m_ready = 0;
     unsigned long start;
     if (eATRST()) {
-        delay(2000);
-        start = millis();
-        while (millis() - start < 3000) {
+        /* Firmwares without the banner fall through to polling "AT" */
+        recvFind("ready", 5000);
+        start = ESP8266Timer::nowMs();
+        while (ESP8266Timer::nowMs() - start < 3000) {
             if (eAT()) {
-                delay(1500); /* Waiting for stable */
                 return true;
             }
             delay(100);
@@ -92,6 +153,340 @@ bool ESP8266::restart(void)
     return false;
 }
 
+bool ESP8266::beginBringup(uint8_t mode, const char *ssid, const char *pwd, bool reset,
+                           ap_cache_t *cache)
+{
+    if (m_bringup != BRINGUP_IDLE && m_bringup != BRINGUP_DONE && m_bringup != BRINGUP_FAILED) {
+        return false;
+    }
+    if (m_pump_id >= 0) {
+        logError("Bring-up while the pump runs, stop() it first\r\n");
+        return false;
+    }
+
+    m_bringup_mode = mode;
+    m_bringup_ssid = ssid ? ssid : "";
+    m_bringup_pwd = pwd ? pwd : "";
+    m_bringup_retries = 0;
+    m_bringup_joined = false;
+    m_bringup_cache = cache;
+    m_bringup_start = ESP8266Timer::nowMs();
+    m_bringup_time = 0;
+
+    if (reset) {
+        for (int i =0; i < MAX_MUX; i++) {
+            memset(&(m_connects[i]),  0, sizeof(connection_t));
+        }
+        m_ready = 0;
+        pendingSend("AT+RST", 1000);
+        m_bringup = BRINGUP_RESET;
+    } else {
+        pendingSend("AT", 500);
+        m_bringup = BRINGUP_KICK;
+    }
+    return true;
+}
+
+bringup_state_t ESP8266::pollBringup(void)
+{
+    char cmd[16];
+    const char *p;
+    int8_t ret;
+
+    /* The pump would take the responses, see beginBringup() */
+    if (m_pump_id >= 0 && m_bringup != BRINGUP_IDLE && m_bringup != BRINGUP_DONE
+        && m_bringup != BRINGUP_FAILED) {
+        logError("Bring-up while the pump runs, giving up\r\n");
+        bringupFinish(BRINGUP_FAILED);
+        return m_bringup;
+    }
+
+    switch (m_bringup) {
+        case BRINGUP_RESET:
+            ret = pendingPoll("OK", "ERROR");
+            if (ret == 0) { break; }
+            if (ret != 1) {
+                bringupFinish(BRINGUP_FAILED);
+                break;
+            }
+            pendingSend(NULL, 5000);
+            m_bringup = BRINGUP_WAIT_READY;
+            break;
+
+        case BRINGUP_WAIT_READY:
+            /* On timeout the firmware may just lack the banner, "AT" decides */
+            if (pendingPoll("ready") == 0) { break; }
+            pendingSend("AT", 500);
+            m_bringup = BRINGUP_KICK;
+            break;
+
+        case BRINGUP_KICK:
+            ret = pendingPoll("OK");
+            if (ret == 0) { break; }
+            if (ret != 1) {
+                if (++m_bringup_retries > 6) {
+                    bringupFinish(BRINGUP_FAILED);
+                } else {
+                    pendingSend("AT", 500);
+                }
+                break;
+            }
+            pendingSend("AT+CWMODE?", 1000);
+            m_bringup = BRINGUP_QUERY_MODE;
+            break;
+
+        case BRINGUP_QUERY_MODE:
+            ret = pendingPoll("OK", "ERROR");
+            if (ret == 0) { break; }
+            p = strstr(m_pending.resp, "+CWMODE:");
+            if (ret == 1 && p && atoi(p + 8) == m_bringup_mode) {
+                bringupAfterMode();
+                break;
+            }
+            snprintf(cmd, sizeof(cmd), "AT+CWMODE=%u", m_bringup_mode);
+            pendingSend(cmd, 1000);
+            m_bringup = BRINGUP_SET_MODE;
+            break;
+
+        case BRINGUP_SET_MODE:
+            ret = pendingPoll("OK", "no change", "ERROR");
+            if (ret == 0) { break; }
+            if (ret != 1 && ret != 2) {
+                bringupFinish(BRINGUP_FAILED);
+                break;
+            }
+            bringupAfterMode();
+            break;
+
+        case BRINGUP_QUERY_AP:
+            ret = pendingPoll("OK", "ERROR");
+            if (ret == 0) { break; }
+            p = strstr(m_pending.resp, "+CWJAP:");
+            if (ret == 1 && p && parseAPCache(p + 7, m_bringup_ssid, m_bringup_cache)) {
+                bringupFinish(BRINGUP_DONE);
+                break;
+            }
+            if (m_bringup_joined) {
+                /* Joined but the query is not understood, leave the cache alone */
+                bringupFinish(BRINGUP_DONE);
+                break;
+            }
+            {
+                String join = "AT+CWJAP=\"";
+                join += m_bringup_ssid;
+                join += "\",\"";
+                join += m_bringup_pwd;
+                join += "\"";
+                if (m_bringup_cache && m_bringup_cache->valid) {
+                    join += ",\"";
+                    join += m_bringup_cache->bssid;
+                    join += "\"";
+                }
+                pendingSend(join.c_str(), 15000);
+            }
+            m_bringup = BRINGUP_JOIN_AP;
+            break;
+
+        case BRINGUP_JOIN_AP:
+            ret = pendingPoll("OK", "FAIL", "ERROR");
+            if (ret == 0) { break; }
+            if (ret != 1 && m_bringup_cache && m_bringup_cache->valid) {
+                /* Pinned join failed, retry with a full scan */
+                m_bringup_cache->valid = 0;
+                pendingSend("AT+CWJAP?", 1000);
+                m_bringup = BRINGUP_QUERY_AP;
+                break;
+            }
+            if (ret != 1) {
+                bringupFinish(BRINGUP_FAILED);
+                break;
+            }
+            if (!m_bringup_cache) {
+                bringupFinish(BRINGUP_DONE);
+                break;
+            }
+            m_bringup_joined = true;
+            pendingSend("AT+CWJAP?", 1000);
+            m_bringup = BRINGUP_QUERY_AP;
+            break;
+
+        default:
+            break;
+    }
+    return m_bringup;
+}
+
+bringup_state_t ESP8266::getBringupState(void)
+{
+    return m_bringup;
+}
+
+uint32_t ESP8266::getBringupTime(void)
+{
+    if (m_bringup == BRINGUP_IDLE || m_bringup == BRINGUP_DONE || m_bringup == BRINGUP_FAILED) {
+        return m_bringup_time;
+    }
+    return ESP8266Timer::nowMs() - m_bringup_start;
+}
+
+void ESP8266::bringupAfterMode(void)
+{
+    if (m_bringup_ssid.length() == 0) {
+        bringupFinish(BRINGUP_DONE);
+        return;
+    }
+    pendingSend("AT+CWJAP?", 1000);
+    m_bringup = BRINGUP_QUERY_AP;
+}
+
+void ESP8266::bringupFinish(bringup_state_t state)
+{
+    m_bringup_time = ESP8266Timer::nowMs() - m_bringup_start;
+    m_bringup = state;
+}
+
+static const char *config_query[CFG_KEYS] = {
+    "AT+CWMODE?",       /* CFG_MODE */
+    "AT+CIPMUX?",       /* CFG_MUX */
+    "AT+CIPSTO?",       /* CFG_SERVER_TIMEOUT */
+    NULL,               /* CFG_SERVER, no query before AT 2.0 */
+    "AT+CWDHCP?",       /* CFG_DHCP */
+    "AT+CWSAP?",        /* CFG_SOFTAP */
+};
+
+bool ESP8266::configure(config_item_t *items, uint8_t count)
+{
+    String current[CFG_KEYS];
+    bool queried[CFG_KEYS];
+    bool ok = true;
+    int8_t ret;
+
+    commandLock();
+    memset(queried, 0, sizeof(queried));
+    for (uint8_t i = 0; i < count; i++) {
+        config_key_t key = items[i].key;
+        items[i].result = CFG_PENDING;
+        if (key >= CFG_KEYS || queried[key] || !config_query[key]) {
+            continue;
+        }
+        queried[key] = true;
+        if (commandWait(config_query[key], 1000, "OK", "ERROR") == 1) {
+            current[key] = m_pending.resp;
+        }
+    }
+
+    for (uint8_t i = 0; i < count; i++) {
+        config_item_t *item = &items[i];
+        if (item->key >= CFG_KEYS) {
+            item->result = CFG_FAILED;
+            ok = false;
+            continue;
+        }
+        if (configInEffect(item, current[item->key].c_str())) {
+            item->result = CFG_SKIPPED;
+            continue;
+        }
+
+        String cmd = configCommand(item);
+        ret = commandWait(cmd.c_str(), item->key == CFG_SOFTAP ? 5000 : 1000, "OK", "no change", "ERROR");
+        if (ret == 1) {
+            item->result = CFG_APPLIED;
+        } else if (ret == 2) {
+            item->result = CFG_SKIPPED;
+        } else {
+            item->result = CFG_FAILED;
+            ok = false;
+        }
+    }
+    commandUnlock();
+    return ok;
+}
+
+bool ESP8266::configInEffect(const config_item_t *item, const char *current)
+{
+    const char *p;
+    uint32_t dhcp;
+
+    switch (item->key) {
+        case CFG_MODE:
+            p = strstr(current, "+CWMODE:");
+            return p && (uint32_t)atol(p + 8) == item->value;
+        case CFG_MUX:
+            p = strstr(current, "+CIPMUX:");
+            return p && (uint32_t)atol(p + 8) == item->value;
+        case CFG_SERVER_TIMEOUT:
+            p = strstr(current, "+CIPSTO:");
+            return p && (uint32_t)atol(p + 8) == item->value;
+        case CFG_DHCP:
+            p = strstr(current, "+CWDHCP:");
+            if (!p) {
+                return false;
+            }
+            dhcp = dhcpBits(item->value);
+            return (((uint32_t)atol(p + 8) & dhcp) == (item->arg ? dhcp : 0));
+        case CFG_SOFTAP: {
+            p = strstr(current, "+CWSAP:");
+            if (!p || !item->ssid || !item->pwd) {
+                return false;
+            }
+            String expect = "+CWSAP:\"";
+            expect += item->ssid;
+            expect += "\",\"";
+            expect += item->pwd;
+            expect += "\",";
+            expect += String((unsigned long)item->value);
+            expect += ",";
+            expect += String((unsigned)item->arg);
+            return strncmp(p, expect.c_str(), expect.length()) == 0;
+        }
+        default:
+            return false;
+    }
+}
+
+String ESP8266::configCommand(const config_item_t *item)
+{
+    String cmd;
+    switch (item->key) {
+        case CFG_MODE:
+            cmd = "AT+CWMODE=";
+            cmd += String((unsigned long)item->value);
+            break;
+        case CFG_MUX:
+            cmd = "AT+CIPMUX=";
+            cmd += String((unsigned long)item->value);
+            break;
+        case CFG_SERVER_TIMEOUT:
+            cmd = "AT+CIPSTO=";
+            cmd += String((unsigned long)item->value);
+            break;
+        case CFG_SERVER:
+            if (item->value) {
+                cmd = "AT+CIPSERVER=1,";
+                cmd += String((unsigned long)item->value);
+            } else {
+                cmd = "AT+CIPSERVER=0";
+            }
+            break;
+        case CFG_DHCP:
+            cmd = dhcpCommand(item->value, item->arg);
+            break;
+        case CFG_SOFTAP:
+            cmd = "AT+CWSAP=\"";
+            cmd += item->ssid ? item->ssid : "";
+            cmd += "\",\"";
+            cmd += item->pwd ? item->pwd : "";
+            cmd += "\",";
+            cmd += String((unsigned long)item->value);
+            cmd += ",";
+            cmd += String((unsigned)item->arg);
+            break;
+        default:
+            break;
+    }
+    return cmd;
+}
+
 String ESP8266::getVersion(void)
 {
     String version;
@@ -99,6 +494,60 @@ String ESP8266::getVersion(void)
     return version;
 }
 
+uint32_t ESP8266::probeCapabilities(void)
+{
+    String version;
+    int32_t index;
+
+    m_caps = 0;
+    m_at_version = 0;
+    if (eATGMR(version)) {
+        index = version.indexOf("AT version:");
+        if (index != -1) {
+            String num = version.substring(index + 11);
+            m_at_version = (uint16_t)(num.toInt() << 8);
+            index = num.indexOf('.');
+            if (index != -1) {
+                m_at_version |= (uint8_t)num.substring(index + 1).toInt();
+            }
+        }
+    }
+
+    if (probeCommand("AT+UART_CUR?")) {
+        m_caps |= CAP_UART_CUR;
+    }
+    m_caps |= CAP_PROBED;
+
+    /* AT 1.0 and later take the full 2048 bytes per CIPSEND */
+    m_tx_chunk = m_at_version >= 0x0100 ? TX_CHUNK_MAX : TX_CHUNK_LEN;
+    return m_caps;
+}
+
+uint32_t ESP8266::getCapabilities(void)
+{
+    return m_caps;
+}
+
+uint16_t ESP8266::getATVersion(void)
+{
+    return m_at_version;
+}
+
+bool ESP8266::setTxChunk(uint16_t len)
+{
+    if (len == 0 || len > TX_CHUNK_MAX) {
+        return false;
+    }
+    Threads::Scope m(_tx_lock);
+    m_tx_chunk = len;
+    return true;
+}
+
+uint16_t ESP8266::getTxChunk(void)
+{
+    return m_tx_chunk;
+}
+
 bool ESP8266::setOprToStation(void)
 {
     uint8_t mode;
@@ -162,6 +611,24 @@ bool ESP8266::joinAP(String ssid, String pwd)
     return sATCWJAP(ssid, pwd);
 }
 
+bool ESP8266::joinAP(String ssid, String pwd, ap_cache_t *cache)
+{
+    bool joined = false;
+    if (cache && cache->valid) {
+        joined = sATCWJAP(ssid, pwd, cache->bssid, 5000);
+        if (!joined) {
+            cache->valid = 0;
+        }
+    }
+    if (!joined) {
+        joined = sATCWJAP(ssid, pwd);
+    }
+    if (joined && cache) {
+        qATCWJAP(ssid, cache);
+    }
+    return joined;
+}
+
 bool ESP8266::enableClientDHCP(uint8_t mode, boolean enabled)
 {
     return sATCWDHCP(mode, enabled);
@@ -237,13 +704,24 @@ bool ESP8266::unregisterUDP(void)
 
 bool ESP8266::createTCP(uint8_t mux_id, String addr, uint32_t port)
 {
-    return sATCIPSTARTMultiple(mux_id, "TCP", addr, port);
+    /* The reply is read here, keep the pump off the UART */
+    commandLock();
+    bool ret = sATCIPSTARTMultiple(mux_id, "TCP", addr, port);
+    if (ret && mux_id < MAX_MUX) {
+        m_connects[mux_id].state = OPEN;
+    }
+    commandUnlock();
+    return ret;
 }
 
 bool ESP8266::releaseTCP(uint8_t mux_id)
 {
-    Threads::Scope m(_lock);
+    Threads::Scope m_rx(_rx_lock);
+    Threads::Scope m_tx(_tx_lock);
     bool ret = sATCIPCLOSEMulitple(mux_id);
+    if (mux_id < MAX_MUX) {
+        m_connects[mux_id].state = CLOSED;
+    }
     if (ret) {
 //        Console.printf("RX closing muxid %d success\r\n", mux_id);
     }
@@ -255,12 +733,18 @@ bool ESP8266::releaseTCP(uint8_t mux_id)
 
 bool ESP8266::registerUDP(uint8_t mux_id, String addr, uint32_t port)
 {
-    return sATCIPSTARTMultiple(mux_id, "UDP", addr, port);
+    commandLock();
+    bool ret = sATCIPSTARTMultiple(mux_id, "UDP", addr, port);
+    commandUnlock();
+    return ret;
 }
 
 bool ESP8266::unregisterUDP(uint8_t mux_id)
 {
-    return sATCIPCLOSEMulitple(mux_id);
+    commandLock();
+    bool ret = sATCIPCLOSEMulitple(mux_id);
+    commandUnlock();
+    return ret;
 }
 
 bool ESP8266::setTCPServerTimeout(uint32_t timeout)
@@ -300,108 +784,395 @@ bool ESP8266::send(const uint8_t *buffer, uint32_t len)
 
 bool ESP8266::send(uint8_t mux_id, const uint8_t *buffer, uint32_t len)
 {
-    Threads::Scope m(_lock);
-    Console.printf("Sending len {%d}\r\n", len);
+    Threads::Scope m_rx(_rx_lock);
+    Threads::Scope m_tx(_tx_lock);
+    logDebug("Sending len {%d}\r\n", len);
     return sATCIPSENDMultiple(mux_id, buffer, len);
 }
 
 
+static inline uint16_t rx_count(connection_t *cn) {
+    return __atomic_load_n(&cn->rx_head, __ATOMIC_ACQUIRE) - __atomic_load_n(&cn->rx_tail, __ATOMIC_ACQUIRE);
+}
+
+static inline uint8_t tx_count(connection_t *cn) {
+    return __atomic_load_n(&cn->tx_head, __ATOMIC_ACQUIRE) - __atomic_load_n(&cn->tx_tail, __ATOMIC_ACQUIRE);
+}
+
+static inline void ready_set(volatile uint32_t *ready, uint32_t bit) {
+    __atomic_fetch_or(ready, bit, __ATOMIC_RELEASE);
+}
+
+static inline uint32_t ready_load(volatile uint32_t *ready) {
+    return __atomic_load_n(ready, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Called by the consumer after it advanced its tail. The producer sets the
+ * bit after publishing, so a push racing with the clear is caught by the
+ * second look at the ring.
+ */
+static inline void rx_settle(volatile uint32_t *ready, connection_t *cn, uint8_t mux) {
+    if (rx_count(cn) == 0) {
+        __atomic_fetch_and(ready, ~READY_RX(mux), __ATOMIC_ACQ_REL);
+        if (rx_count(cn) > 0) {
+            ready_set(ready, READY_RX(mux));
+        }
+    }
+}
+
+static inline void tx_settle(volatile uint32_t *ready, connection_t *cn, uint8_t mux) {
+    if (tx_count(cn) == 0) {
+        __atomic_fetch_and(ready, ~READY_TX(mux), __ATOMIC_ACQ_REL);
+        if (tx_count(cn) > 0) {
+            ready_set(ready, READY_TX(mux));
+        }
+    }
+}
+
 bool ESP8266::queue(uint8_t mux_id, const uint8_t *buffer, uint32_t len)
 {
-    connection_t* cn = &GConnects[mux_id];
-    Threads::Scope m(cn->tx_lock);
+    connection_t* cn = &m_connects[mux_id];
+    uint8_t head = cn->tx_head;
 
-    if (cn->tx_len != 0) {
+    if (len > 0xFFFF || tx_count(cn) >= TX_QUEUE_DEPTH) {
         return false;
     }
+    if (len == 0) {
+        return true;
+    }
 
-    cn->tx_data = (char*) buffer;
-    cn->tx_len=len;
-    cn->seg_state = QUEUED;
+    m_tx_ring[mux_id][head % TX_QUEUE_DEPTH].data = (const char*) buffer;
+    m_tx_ring[mux_id][head % TX_QUEUE_DEPTH].len = len;
+    m_tx_ring[mux_id][head % TX_QUEUE_DEPTH].queued_us = ESP8266Timer::nowUs();
+    capture(CAP_QUEUE, mux_id, buffer, len);
+    __atomic_store_n(&cn->tx_head, (uint8_t)(head + 1), __ATOMIC_RELEASE);
+    ready_set(&m_ready, READY_TX(mux_id));
     return true;
 }
 
+cxn_state_t ESP8266::getLinkState(uint8_t mux_id) {
+    return (cxn_state_t) m_connects[mux_id].state;
+}
+
+uint8_t ESP8266::getQueued(uint8_t mux_id) {
+    return tx_count(&m_connects[mux_id]);
+}
+
 seg_state_t ESP8266::getTransferState(uint8_t mux) {
-    connection_t* cn = &GConnects[mux];
-    Threads::Scope m(cn->tx_lock);
-    return cn->seg_state;
+    connection_t* cn = &m_connects[mux];
+    if (tx_count(cn) > 0) {
+        return QUEUED;
+    }
+    return (seg_state_t) cn->seg_state;
 }
 
 bool ESP8266::queueAvail(uint8_t mux_id) {
-    connection_t* cn = &GConnects[mux_id];
-    Threads::Scope m(cn->tx_lock);
+    return tx_count(&m_connects[mux_id]) < TX_QUEUE_DEPTH;
+}
 
-    if (cn->tx_len != 0) {
-        return false;
+#ifdef ESP8266_HOST
+const char *ESP8266::checkInvariants(void) {
+    Threads::Scope r(_rx_lock);
+    Threads::Scope t(_tx_lock);
+
+    if (m_ctx.iter >= ESP8266_PARSER_BUF) {
+        return "parser iter past the buffer";
+    }
+    if (m_ctx.ipd_mux >= MAX_MUX) {
+        return "parser mux out of range";
+    }
+    if (m_ctx_tx.mux_id >= MAX_MUX || m_ctx_tx.last_mux >= MAX_MUX) {
+        return "TX mux out of range";
+    }
+    for (uint8_t i = 0; i < MAX_MUX; i++) {
+        connection_t *cn = &m_connects[i];
+        if (rx_count(cn) > ESP8266_RX_CAPACITY) {
+            return "RX ring over capacity";
+        }
+        if (tx_count(cn) > TX_QUEUE_DEPTH) {
+            return "TX ring over depth";
+        }
+        if (tx_count(cn) > 0 && cn->tx_wrote > m_tx_ring[i][cn->tx_tail % TX_QUEUE_DEPTH].len) {
+            return "TX offset past the segment";
+        }
     }
+    return NULL;
+}
+#endif
+
+bool ESP8266::attachRxBuffer(void *buffer, size_t size)
+{
+#if !defined(ESP8266_USE_SOFTWARE_SERIAL) && defined(TEENSYDUINO) && TEENSYDUINO >= 148
+    Threads::Scope m(_rx_lock);
+    m_puart->addMemoryForRead(buffer, size);
+    m_rx_capacity = size + RX_CORE_BUFFER - 1;
     return true;
+#else
+    (void)buffer;
+    (void)size;
+    return false;
+#endif
 }
 
-void ESP8266::rx_empty(void)
+uint32_t ESP8266::getRxOverruns(void)
 {
-    while(m_puart->available() > 0) {
-        m_puart->read();
-    }
+    return m_counters.uart_overruns;
 }
 
-String ESP8266::recvString(String target, uint32_t timeout)
+/*
+ * Counters are bumped from the parser, the TX engine and the AT helpers,
+ * which don't all share a lock.
+ */
+static inline void count(uint32_t *counter, uint32_t n = 1)
 {
-    String data;
-    char a;
-    unsigned long start = millis();
-    bool found = false;
-    while (millis() - start < timeout) {
-        while(m_puart->available() > 0) {
-            a = m_puart->read();
-            if(a == '\0') continue;
-            data += a;
-            if (data.indexOf(target) != -1) {
-                found = true;
-                break;
-            }
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+/*
+ * Threads::Scope that accounts the time spent blocked.
+ */
+class TimedScope {
+ public:
+    TimedScope(Threads::Mutex &m, uint32_t *wait_us) : r(m) {
+        if (!r.try_lock()) {
+            uint32_t start = ESP8266Timer::nowUs();
+            r.lock();
+            count(wait_us, ESP8266Timer::nowUs() - start);
         }
-        if (found) { break; }
     }
-    return data;
+    ~TimedScope() { r.unlock(); }
+ private:
+    Threads::Mutex &r;
+};
+
+static void latency_record(latency_hist_t *h, uint32_t us)
+{
+    uint8_t i = us ? 32 - __builtin_clz(us) : 0;
+    if (i >= LAT_BUCKETS) {
+        i = LAT_BUCKETS - 1;
+    }
+    count(&h->bucket[i]);
+    count(&h->count);
+
+    uint32_t max = __atomic_load_n(&h->max_us, __ATOMIC_RELAXED);
+    while (us > max && !__atomic_compare_exchange_n(&h->max_us, &max, us, true,
+                                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
 }
 
-String ESP8266::recvString(String target1, String target2, uint32_t timeout)
+uint32_t ESP8266::getLatency(latency_kind_t kind, uint8_t percentile)
 {
-    String data;
-    char a;
-    unsigned long start = millis();
-    while (millis() - start < timeout) {
-        while(m_puart->available() > 0) {
-            a = m_puart->read();
-            if(a == '\0')  {
-                continue; 
-            }
-            data += a;
-        }
-        if (data.indexOf(target1) != -1) {
-            break;
-        } else if (data.indexOf(target2) != -1) {
-            break;
+    latency_hist_t h;
+    getLatencyHistogram(kind, &h);
+    if (h.count == 0) {
+        return 0;
+    }
+    if (percentile > 100) {
+        percentile = 100;
+    }
+
+    uint32_t rank = ((uint64_t)h.count * percentile + 99) / 100;
+    uint32_t seen = 0;
+    for (uint8_t i = 0; i < LAT_BUCKETS - 1; i++) {
+        seen += h.bucket[i];
+        if (seen >= rank) {
+            uint32_t upper = i ? (1UL << i) - 1 : 0;
+            return upper < h.max_us ? upper : h.max_us;
         }
     }
-    return data;
+    return h.max_us;
 }
 
-String ESP8266::recvString(String target1, String target2, String target3, uint32_t timeout)
+void ESP8266::getLatencyHistogram(latency_kind_t kind, latency_hist_t *out)
 {
-    String data;
-    char a;
-    unsigned long start = millis();
-    while (millis() - start < timeout) {
-        while(m_puart->available() > 0) {
-            a = m_puart->read();
-            if(a == '\0') { 
-                continue; 
-            }
-            data += a;
-        }
-        if (data.indexOf(target1) != -1) {
-            break;
+    latency_hist_t *h = &m_latency[kind];
+    for (uint8_t i = 0; i < LAT_BUCKETS; i++) {
+        out->bucket[i] = __atomic_load_n(&h->bucket[i], __ATOMIC_RELAXED);
+    }
+    out->count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+    out->max_us = __atomic_load_n(&h->max_us, __ATOMIC_RELAXED);
+}
+
+void ESP8266::resetLatency(void)
+{
+    Threads::Scope m_rx(_rx_lock);
+    Threads::Scope m_tx(_tx_lock);
+    memset(m_latency, 0, sizeof(m_latency));
+}
+
+void ESP8266::trace(uint8_t event, uint8_t mux, uint8_t state, uint16_t len)
+{
+#if ESP8266_TRACE_DEPTH
+    if (__atomic_load_n(&m_trace_frozen, __ATOMIC_RELAXED)) {
+        return;
+    }
+    /* Parser and TX engine record concurrently, each reserves its own slot */
+    uint32_t at = __atomic_fetch_add(&m_trace_head, 1, __ATOMIC_RELAXED);
+    trace_rec_t *rec = &m_trace[at % ESP8266_TRACE_DEPTH];
+    rec->us = ESP8266Timer::nowUs();
+    rec->len = len;
+    rec->event = event;
+    rec->info = (mux << 4) | (state & 0x0F);
+#endif
+}
+
+void ESP8266::traceFault(uint8_t event, uint8_t mux, uint8_t state, uint16_t len)
+{
+    trace(event, mux, state, len);
+    if (m_trace_on_fault) {
+        traceFreeze();
+    }
+}
+
+uint16_t ESP8266::traceRead(trace_rec_t *out, uint16_t max)
+{
+#if ESP8266_TRACE_DEPTH
+    uint32_t head = __atomic_load_n(&m_trace_head, __ATOMIC_ACQUIRE);
+    uint32_t n = head < ESP8266_TRACE_DEPTH ? head : ESP8266_TRACE_DEPTH;
+    if (n > max) {
+        n = max;
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        out[i] = m_trace[(head - n + i) % ESP8266_TRACE_DEPTH];
+    }
+    return n;
+#else
+    return 0;
+#endif
+}
+
+uint16_t ESP8266::traceDump(Print &out)
+{
+    uint16_t n = 0;
+#if ESP8266_TRACE_DEPTH
+    uint32_t head = __atomic_load_n(&m_trace_head, __ATOMIC_ACQUIRE);
+    n = head < ESP8266_TRACE_DEPTH ? head : ESP8266_TRACE_DEPTH;
+#endif
+    uint8_t hdr[8] = { 'E', '8', 'T', 'R',
+                       (uint8_t)n, (uint8_t)(n >> 8),
+                       sizeof(trace_rec_t), 0 };
+    out.write(hdr, sizeof(hdr));
+#if ESP8266_TRACE_DEPTH
+    for (uint16_t i = 0; i < n; i++) {
+        trace_rec_t rec = m_trace[(head - n + i) % ESP8266_TRACE_DEPTH];
+        out.write((const uint8_t*)&rec, sizeof(rec));
+    }
+#endif
+    return n;
+}
+
+void ESP8266::traceFreeze(void)
+{
+    __atomic_store_n(&m_trace_frozen, 1, __ATOMIC_RELEASE);
+}
+
+void ESP8266::traceResume(bool clear)
+{
+    if (clear) {
+        __atomic_store_n(&m_trace_head, 0, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&m_trace_frozen, 0, __ATOMIC_RELEASE);
+}
+
+void ESP8266::traceFreezeOnFault(bool enable)
+{
+    m_trace_on_fault = enable;
+}
+
+bool ESP8266::traceFrozen(void)
+{
+    return __atomic_load_n(&m_trace_frozen, __ATOMIC_RELAXED);
+}
+
+void ESP8266::getCounters(counters_t *out)
+{
+    Threads::Scope m_rx(_rx_lock);
+    Threads::Scope m_tx(_tx_lock);
+    for (size_t i = 0; i < sizeof(*out) / sizeof(uint32_t); i++) {
+        ((uint32_t*)out)[i] = __atomic_load_n(&((uint32_t*)&m_counters)[i], __ATOMIC_RELAXED);
+    }
+}
+
+void ESP8266::resetCounters(void)
+{
+    Threads::Scope m_rx(_rx_lock);
+    Threads::Scope m_tx(_tx_lock);
+    for (size_t i = 0; i < sizeof(m_counters) / sizeof(uint32_t); i++) {
+        __atomic_store_n(&((uint32_t*)&m_counters)[i], 0, __ATOMIC_RELAXED);
+    }
+}
+
+void ESP8266::rx_empty(void)
+{
+    uint32_t n = 0;
+    while(m_puart->available() > 0) {
+        m_puart->read();
+        n++;
+    }
+    if (n) {
+        count(&m_counters.rx_discarded, n);
+    }
+}
+
+String ESP8266::recvString(String target, uint32_t timeout)
+{
+    String data;
+    char a;
+    unsigned long start = ESP8266Timer::nowMs();
+    bool found = false;
+    while (ESP8266Timer::nowMs() - start < timeout) {
+        while(m_puart->available() > 0) {
+            a = m_puart->read();
+            if(a == '\0') continue;
+            data += a;
+            if (data.indexOf(target) != -1) {
+                found = true;
+                break;
+            }
+        }
+        if (found) { break; }
+    }
+    return data;
+}
+
+String ESP8266::recvString(String target1, String target2, uint32_t timeout)
+{
+    String data;
+    char a;
+    unsigned long start = ESP8266Timer::nowMs();
+    while (ESP8266Timer::nowMs() - start < timeout) {
+        while(m_puart->available() > 0) {
+            a = m_puart->read();
+            if(a == '\0')  {
+                continue; 
+            }
+            data += a;
+        }
+        if (data.indexOf(target1) != -1) {
+            break;
+        } else if (data.indexOf(target2) != -1) {
+            break;
+        }
+    }
+    return data;
+}
+
+String ESP8266::recvString(String target1, String target2, String target3, uint32_t timeout)
+{
+    String data;
+    char a;
+    unsigned long start = ESP8266Timer::nowMs();
+    while (ESP8266Timer::nowMs() - start < timeout) {
+        while(m_puart->available() > 0) {
+            a = m_puart->read();
+            if(a == '\0') { 
+                continue; 
+            }
+            data += a;
+        }
+        if (data.indexOf(target1) != -1) {
+            break;
         } else if (data.indexOf(target2) != -1) {
             break;
         } else if (data.indexOf(target3) != -1) {
@@ -442,11 +1213,11 @@ bool ESP8266::recvFindAndFilter_dbg(String target, String begin, String end, Str
 {
     String data_tmp;
     data_tmp = recvString(target, timeout);
-    Console.printf("Rxed: %s\r\n", data_tmp.c_str());
+    logDebug("Rxed: %s\r\n", data_tmp.c_str());
     if (data_tmp.indexOf(target) != -1) {
         int32_t index1 = data_tmp.indexOf(begin);
         int32_t index2 = data_tmp.indexOf(end);
-        Console.printf("Rxed index 1 vs index 2: %d %d\r\n", index1, index2);
+        logDebug("Rxed index 1 vs index 2: %d %d\r\n", index1, index2);
         if (index1 != -1 && index2 != -1) {
             index1 += begin.length();
             data = data_tmp.substring(index1, index2);
@@ -511,7 +1282,7 @@ bool ESP8266::sATCWMODE(uint8_t mode)
     return false;
 }
 
-bool ESP8266::sATCWJAP(String ssid, String pwd)
+bool ESP8266::sATCWJAP(String ssid, String pwd, const char *bssid, uint32_t timeout)
 {
     String data;
     rx_empty();
@@ -519,28 +1290,93 @@ bool ESP8266::sATCWJAP(String ssid, String pwd)
     m_puart->print(ssid);
     m_puart->print("\",\"");
     m_puart->print(pwd);
+    if (bssid) {
+        m_puart->print("\",\"");
+        m_puart->print(bssid);
+    }
     m_puart->println("\"");
     
-    data = recvString("OK", "FAIL", 10000);
+    data = recvString("OK", "FAIL", timeout);
     if (data.indexOf("OK") != -1) {
         return true;
     }
     return false;
 }
 
-bool ESP8266::sATCWDHCP(uint8_t mode, boolean enabled)
+bool ESP8266::qATCWJAP(String ssid, ap_cache_t *cache)
 {
-    String strEn = "0";
-    if (enabled) {
-        strEn = "1";
+    String data;
+    rx_empty();
+    m_puart->println("AT+CWJAP?");
+    if (!recvFindAndFilter("OK", "+CWJAP:", "\r\n\r\nOK", data)) {
+        return false;
     }
+    return parseAPCache(data.c_str(), ssid, cache);
+}
 
+/*
+ * cwjap: "ssid","aa:bb:cc:dd:ee:ff",channel,rssi
+ * True when associated with ssid, cache (if any) is then filled in.
+ * Firmwares only reporting the SSID leave the cache invalid.
+ */
+bool ESP8266::parseAPCache(const char *cwjap, String ssid, ap_cache_t *cache)
+{
+    const char *bssid;
+    if (cwjap[0] != '"' || strncmp(cwjap + 1, ssid.c_str(), ssid.length()) != 0
+            || cwjap[1 + ssid.length()] != '"') {
+        return false;
+    }
+    if (!cache) {
+        return true;
+    }
+
+    cache->valid = 0;
+    bssid = cwjap + ssid.length() + 2;
+    if (strncmp(bssid, ",\"", 2) != 0 || strlen(bssid) < 2 + 17 + 2 || bssid[2 + 17] != '"') {
+        return true;
+    }
+    memcpy(cache->bssid, bssid + 2, 17);
+    cache->bssid[17] = '\0';
+    cache->channel = atoi(bssid + 2 + 17 + 2);
+    cache->valid = 1;
+    return true;
+}
+
+/*
+ * AT+CWDHCP, mode 0 - softap, 1 - station, 2 - both. AT 1.x takes
+ * <mode>,<en> and queries bit 0 - softap, bit 1 - station. AT 2.x takes
+ * <en>,<bits> with bit 0 - station, bit 1 - softap, for query and set.
+ * Without probeCapabilities() the firmware is taken for 1.x.
+ */
+uint8_t ESP8266::dhcpBits(uint8_t mode)
+{
+    if (mode >= 2) {
+        return 3;
+    }
+    if (m_at_version >= 0x0200) {
+        return mode == 0 ? 2 : 1;
+    }
+    return mode == 0 ? 1 : 2;
+}
+
+String ESP8266::dhcpCommand(uint8_t mode, bool enabled)
+{
+    String cmd = "AT+CWDHCP=";
+    if (m_at_version >= 0x0200) {
+        cmd += enabled ? "1," : "0,";
+        cmd += String((unsigned)dhcpBits(mode));
+    } else {
+        cmd += String((unsigned)(mode > 2 ? 2 : mode));
+        cmd += enabled ? ",1" : ",0";
+    }
+    return cmd;
+}
+
+bool ESP8266::sATCWDHCP(uint8_t mode, boolean enabled)
+{
     String data;
     rx_empty();
-    m_puart->print("AT+CWDHCP=");
-    m_puart->print(strEn);
-    m_puart->print(",");
-    m_puart->println(mode);
+    m_puart->println(dhcpCommand(mode, enabled));
     
     data = recvString("OK", "FAIL", 10000);
     if (data.indexOf("OK") != -1) {
@@ -595,7 +1431,6 @@ bool ESP8266::eATCWLIF(String &list)
 bool ESP8266::eATCIPSTATUS(String &list)
 {
     String data;
-    delay(100);
     rx_empty();
     m_puart->println("AT+CIPSTATUS");
     return recvFindAndFilter("OK", "\r\r\n", "\r\n\r\nOK", list);
@@ -652,20 +1487,48 @@ bool ESP8266::sATCIPSENDSingle(const uint8_t *buffer, uint32_t len)
 }
 
 bool ESP8266::setupTransmission(uint8_t mux_id, uint32_t len) {
-    m_puart->print("AT+CIPSEND=");
-    m_puart->print(mux_id);
-    m_puart->print(",");
-    m_puart->println(len);
+    char cmd[32];
+    int n = snprintf(cmd, sizeof(cmd), "AT+CIPSEND=%u,%lu\r\n", mux_id, (unsigned long)len);
+    m_puart->write((const uint8_t*)cmd, n);
+    capture(CAP_TX, mux_id, cmd, n);
     return true;
 }
 
 bool ESP8266::transmit(const char *buffer, uint32_t len) {
-    for (uint32_t i = 0; i < len; i++) {
-        m_puart->write(buffer[i]);
-    }
+    m_puart->write((const uint8_t*)buffer, len);
+    capture(CAP_TX, m_ctx_tx.mux_id, buffer, len);
     return true;
 }
 
+void ESP8266::captureStart(Print *sink) {
+    Threads::Scope m(_cap_lock);
+    m_capture = sink;
+    if (sink) {
+        sink->write((const uint8_t*)CAPTURE_MAGIC, 4);
+    }
+}
+
+void ESP8266::captureStop(void) {
+    captureStart(NULL);
+}
+
+void ESP8266::capture(uint8_t type, uint8_t mux, const void *data, uint16_t len) {
+    if (m_capture == NULL || len == 0) {
+        return;
+    }
+    Threads::Scope m(_cap_lock);
+    if (m_capture == NULL) {
+        return;
+    }
+    capture_hdr_t hdr;
+    hdr.us = ESP8266Timer::nowUs();
+    hdr.type = type;
+    hdr.mux = mux;
+    hdr.len = len;
+    m_capture->write((const uint8_t*)&hdr, sizeof(hdr));
+    m_capture->write((const uint8_t*)data, len);
+}
+
 bool ESP8266::sATCIPSENDMultiple(uint8_t mux_id, const uint8_t *buffer, uint32_t len)
 {
     rx_empty();
@@ -675,17 +1538,14 @@ bool ESP8266::sATCIPSENDMultiple(uint8_t mux_id, const uint8_t *buffer, uint32_t
     m_puart->println(len);
 
     char c = 0;
-    int count = 0;
-    tmpBufIndex = 0;
+    uint32_t start = ESP8266Timer::nowMs();
+    uint8_t tmpBufIndex = 0;
+    char tmpBuf[32];
+    memset(tmpBuf, 0, sizeof(tmpBuf));
     while(c != '>') {
-        count++;
-        if (!m_puart->available() && count < 10000) { 
-            continue;
-        }
-
-        if (count > 10000) {
+        if (ESP8266Timer::nowMs() - start >= ESP8266_TX_PROMPT_MS) {
             tmpBuf[sizeof(tmpBuf)-1]='\0';
-            Console.printf("Giving up TX attempt resp [%s] \r\n", tmpBuf);
+            logWarn("Giving up TX attempt resp [%s] \r\n", tmpBuf);
             return false;
         }
 
@@ -698,7 +1558,7 @@ bool ESP8266::sATCIPSENDMultiple(uint8_t mux_id, const uint8_t *buffer, uint32_t
             else {
                 tmpBuf[sizeof(tmpBuf)-1]='\0';
                 tmpBufIndex=0;
-                Console.printf("TX resp [%s] \r\n", tmpBuf);
+                logDebug("TX resp [%s] \r\n", tmpBuf);
             }
         }
         //Console.printf("READ DATA BEFORE SEND {%c}\r\n", c);
@@ -706,7 +1566,7 @@ bool ESP8266::sATCIPSENDMultiple(uint8_t mux_id, const uint8_t *buffer, uint32_t
 
     tmpBuf[sizeof(tmpBuf)-1]='\0';
     tmpBufIndex=0;
-    Console.printf("TX resp [%s] \r\n", tmpBuf);
+    logDebug("TX resp [%s] \r\n", tmpBuf);
 //    
 //    FIXME: THIS is dubious.. ((char*)buffer)[len] = '\0';
 //     Console.printf("TX DATA LENGTH {%d}\r\n", len);
@@ -765,19 +1625,152 @@ bool ESP8266::sATCIPMUX(uint8_t mode)
 }
 
 bool ESP8266::SpecialBaud()
+{
+    return sATUARTCUR(115200, 3);
+}
+
+bool ESP8266::sATUARTCUR(uint32_t baud, uint8_t flow)
 {
     String data;
+    if ((m_caps & CAP_PROBED) && !(m_caps & CAP_UART_CUR) && flow != 0) {
+        logWarn("AT+CIOBAUD has no flow control\r\n");
+        return false;
+    }
     rx_empty();
-    m_puart->print("AT+UART_CUR=115200,8,1,0,3");
-    m_puart->println("");
+    if ((m_caps & CAP_PROBED) && !(m_caps & CAP_UART_CUR)) {
+        /* Older firmwares only know the flow control less command */
+        m_puart->print("AT+CIOBAUD=");
+        m_puart->println(baud);
+    } else {
+        m_puart->print("AT+UART_CUR=");
+        m_puart->print(baud);
+        m_puart->print(",8,1,0,");
+        m_puart->println(flow);
+    }
 
-    data = recvString("OK", "Link is builded");
+    data = recvString("OK", "ERROR");
     if (data.indexOf("OK") != -1) {
         return true;
     }
     return false;
 }
 
+#define BAUD_PROBES 8
+
+uint16_t ESP8266::probeBaud(uint8_t count)
+{
+    uint16_t errors = 0;
+    for (uint8_t i = 0; i < count; i++) {
+        rx_empty();
+        m_puart->println("AT");
+        String data = recvString("OK\r\n", 100);
+        bool clean = data.indexOf("OK\r\n") != -1;
+        for (uint32_t j = 0; clean && j < data.length(); j++) {
+            char c = data[j];
+            if ((c < ' ' || c > '~') && c != '\r' && c != '\n') {
+                clean = false;
+            }
+        }
+        if (!clean) {
+            errors++;
+        }
+    }
+    return errors;
+}
+
+/*
+ * Attach the UART side of a flow control setting of ESP8266.
+ */
+bool ESP8266::attachFlow(uint8_t flow)
+{
+#ifdef ESP8266_USE_SOFTWARE_SERIAL
+    return flow == 0;
+#else
+    if ((flow & 2) && m_rts_pin < 0) {
+        return false;
+    }
+    if ((flow & 1) && m_cts_pin < 0) {
+        return false;
+    }
+    /* An invalid pin (0xFF) detaches */
+    if (flow & 2) {
+        pinMode(m_rts_pin, OUTPUT);
+        m_puart->attachRts(m_rts_pin);
+    } else {
+        m_puart->attachRts(0xFF);
+    }
+    if (flow & 1) {
+        m_puart->attachCts(m_cts_pin);
+    } else {
+        m_puart->attachCts(0xFF);
+    }
+    return true;
+#endif
+}
+
+bool ESP8266::setBaud(uint32_t baud, uint8_t flow)
+{
+    uint32_t prev = m_baud;
+    uint8_t prev_flow = m_flow;
+
+    if (flow > 3 || !attachFlow(flow)) {
+        logWarn("Flow control %u needs a pin the UART doesn't have\r\n", flow);
+        return false;
+    }
+    if (!sATUARTCUR(baud, flow)) {
+        attachFlow(prev_flow);
+        return false;
+    }
+    m_puart->flush();
+    m_puart->begin(baud);
+    delay(5); /* ESP8266 switches after its "OK" left the FIFO */
+
+    m_baud_errors = probeBaud(BAUD_PROBES);
+    if (m_baud_errors == 0) {
+        m_baud = baud;
+        m_flow = flow;
+        return true;
+    }
+
+    /* The command may arrive garbled too, the probe below tells */
+    m_baud_fallbacks++;
+    sATUARTCUR(prev, prev_flow);
+    m_puart->flush();
+    attachFlow(prev_flow);
+    m_puart->begin(prev);
+    delay(5);
+    m_baud = prev;
+    if (probeBaud(1) != 0) {
+        logWarn("Lost ESP8266 falling back to %lu baud\r\n", (unsigned long)prev);
+    }
+    return false;
+}
+
+bool ESP8266::negotiateBaud(const uint32_t *rates, uint8_t count, uint8_t flow)
+{
+    for (uint8_t i = 0; i < count; i++) {
+        if (rates[i] == m_baud || setBaud(rates[i], flow)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+uint32_t ESP8266::getBaud(void)
+{
+    return m_baud;
+}
+
+uint16_t ESP8266::getBaudErrors(void)
+{
+    return m_baud_errors;
+}
+
+uint16_t ESP8266::getBaudFallbacks(void)
+{
+    return m_baud_fallbacks;
+}
+
 bool ESP8266::sATCIPSERVER(uint8_t mode, uint32_t port)
 {
     String data;
@@ -806,77 +1799,295 @@ bool ESP8266::sATCIPSTO(uint32_t timeout)
     return recvFind("OK");
 }
 
+bool ESP8266::probeCommand(const char *cmd)
+{
+    String data;
+    rx_empty();
+    m_puart->println(cmd);
+    data = recvString("OK", "ERROR", 500);
+    if (data.indexOf("OK") != -1) {
+        return true;
+    }
+    return false;
+}
+
+#define WAIT_SPIN_US 1000   /* a waiter yields this long, then sleeps */
+
+/*
+ * Give the time slice away while waiting, and once the wait got nowhere
+ * for WAIT_SPIN_US sleep a tick instead: with no other thread runnable a
+ * yield returns at once and the waiter would keep the core busy. The
+ * first yields keep the latency when the engines are busy and the event
+ * comes soon.
+ */
+static inline void wait_backoff(uint32_t since_us) {
+    if (ESP8266Timer::nowUs() - since_us < WAIT_SPIN_US) {
+        threads.yield();
+    } else {
+        threads.delay(1);
+    }
+}
+
+int8_t ESP8266::commandWait(const char *cmd, uint32_t timeout, const char *target1,
+                            const char *target2, const char *target3)
+{
+    int8_t ret;
+    uint32_t since = ESP8266Timer::nowUs();
+    pendingSend(cmd, timeout);
+    while ((ret = pendingPoll(target1, target2, target3)) == 0) {
+        wait_backoff(since);
+    }
+    return ret;
+}
+
+void ESP8266::pendingSend(const char *cmd, uint32_t timeout)
+{
+    m_pending.len = 0;
+    m_pending.resp[0] = '\0';
+    m_pending.start = ESP8266Timer::nowMs();
+    m_pending.timeout = timeout;
+    if (cmd) {
+        rx_empty();
+        m_puart->println(cmd);
+    }
+}
+
+int8_t ESP8266::pendingPoll(const char *target1, const char *target2, const char *target3)
+{
+    char a;
+    while (m_puart->available() > 0) {
+        a = m_puart->read();
+        if (a == '\0') {
+            continue;
+        }
+        /* Keep the tail, targets terminate a response */
+        if (m_pending.len >= sizeof(m_pending.resp) - 1) {
+            uint16_t keep = sizeof(m_pending.resp) / 2;
+            memmove(m_pending.resp, m_pending.resp + m_pending.len - keep, keep);
+            m_pending.len = keep;
+        }
+        m_pending.resp[m_pending.len++] = a;
+        m_pending.resp[m_pending.len] = '\0';
+
+        if (strstr(m_pending.resp, target1)) {
+            return 1;
+        } else if (target2 && strstr(m_pending.resp, target2)) {
+            return 2;
+        } else if (target3 && strstr(m_pending.resp, target3)) {
+            return 3;
+        }
+    }
+    if (ESP8266Timer::nowMs() - m_pending.start >= m_pending.timeout) {
+        return -1;
+    }
+    return 0;
+}
+
 
 #define IPD_HEADER "+IPD,"
 #define IPD_HEADER_LEN 5
+/* The firmware sends up to 1460 bytes per frame, far longer is line noise */
+#define IPD_FRAME_MAX 8192
 
 
-int recv_state = 0;
-int tx_state = 0;
-int rx_iter = 0;
-int tx_iter = 0;
 
-void reset_rx_ctx() {
-    ctx.state = NEW_CMD;
-    ctx.iter = 0;
-    ctx.ipd_length = 0;
-    ctx.ipd_mux    = 0;
-    ctx.ipd_mux_term_index = 0;
-    ctx.ipd_header_length = 0;
+/*
+ * Events are sequence counters, a waiter samples the counter, checks its
+ * condition and then sleeps until the counter moves on. TeensyThreads has
+ * no blocking wait, sleeping is giving the time slice away, see
+ * wait_backoff().
+ */
+static inline void event_notify(volatile uint32_t *ev) {
+    __atomic_fetch_add(ev, 1, __ATOMIC_RELEASE);
 }
 
-void reset_tx_ctx() {
-    ctx_tx.state = READY;
-    ctx_tx.requested_tx_len = 0;
-     ctx_tx.failed = false;
-   ctx_tx.mux_id = 0;
-    ctx_tx.reason[0] = '\0';
-    //memset(ctx_tx.reason, 0, sizeof(ctx_tx.reason));
+static inline uint32_t event_sample(volatile uint32_t *ev) {
+    return __atomic_load_n(ev, __ATOMIC_ACQUIRE);
 }
 
-void reset_tx_ctx_failed(uint8_t mux) {
-    ctx_tx.failed = ctx_tx.failed ^ (1 << mux);
+static bool event_wait(volatile uint32_t *ev, uint32_t seen, unsigned long start, uint32_t timeout) {
+    uint32_t since = ESP8266Timer::nowUs();
+    while (event_sample(ev) == seen) {
+        if (ESP8266Timer::nowMs() - start >= timeout) {
+            return false;
+        }
+        wait_backoff(since);
+    }
+    return true;
+}
+
+void ESP8266::reset_rx_ctx() {
+    m_ctx.state = NEW_CMD;
+    m_ctx.iter = 0;
+    m_ctx.ipd_length = 0;
+    m_ctx.ipd_got = 0;
+    m_ctx.ipd_mux    = 0;
+    m_ctx.ipd_mux_term_index = 0;
+    m_ctx.ipd_drop = false;
+    m_timers.cancel(&m_rx_timer);
+    event_notify(&m_ctx_tx.idle_event);
+}
+
+void ESP8266::reset_tx_ctx() {
+    m_ctx_tx.state = READY;
+    m_ctx_tx.requested_tx_len = 0;
+     m_ctx_tx.failed = false;
+   m_ctx_tx.mux_id = 0;
+    m_ctx_tx.held = 0;
+    m_ctx_tx.reason[0] = '\0';
+    //memset(m_ctx_tx.reason, 0, sizeof(m_ctx_tx.reason));
+    m_timers.cancel(&m_tx_timer);
+    event_notify(&m_ctx_tx.idle_event);
 }
 
-void set_tx_ctx_failed(uint8_t mux) {
-    ctx_tx.failed = ctx_tx.failed | (1 << mux);
+void ESP8266::reset_tx_ctx_failed(uint8_t mux) {
+    m_ctx_tx.failed = m_ctx_tx.failed ^ (1 << mux);
+}
+
+void ESP8266::set_tx_ctx_failed(uint8_t mux) {
+    m_ctx_tx.failed = m_ctx_tx.failed | (1 << mux);
 }
 
 void ESP8266::softReset() {
     reset_tx_ctx();
     reset_rx_ctx();
-    for (int i =0; i < 5; i++) {
-        memset(&(GConnects[i]),  0, sizeof(connection_t));
+    for (int i =0; i < MAX_MUX; i++) {
+        memset(&(m_connects[i]),  0, sizeof(connection_t));
     }
+    m_ready = 0;
 }
 
+#define RX_CHUNK 64
+
 void ESP8266::super_recv(void) {
     //Console.printf("ENTER super recv\r\n");
-    connection_t* cn = NULL;
-    char c = 0;
-    char* parser = NULL;
-    Threads::Scope m(_lock);
+    char chunk[RX_CHUNK];
+    int available;
+    int len;
+    TimedScope m(_rx_lock, &m_counters.rx_lock_wait_us);
     //Console.printf("    locked wifi\r\n");
 
-    rx_iter = (rx_iter + 1) % 16;
-    if (m_puart->available() <= 0) {
-        goto done;
+    available = m_puart->available();
+    if (available <= 0) {
+        return;
+    }
+    /* A full ring means the UART interrupt had to drop bytes */
+    if (m_rx_capacity && (uint32_t)available >= m_rx_capacity) {
+        count(&m_counters.uart_overruns);
+    }
+
+    len = m_puart->readBytes(chunk, available < RX_CHUNK ? available : RX_CHUNK);
+    capture(CAP_RX, 0, chunk, len);
+    parse_chunk(chunk, len);
+}
+
+void ESP8266::feed(const char *data, size_t len) {
+    Threads::Scope m(_rx_lock);
+    while (len > 0) {
+        int n = len < RX_CHUNK ? len : RX_CHUNK;
+        parse_chunk(data, n);
+        data += n;
+        len -= n;
+    }
+}
+
+void ESP8266::parse_chunk(const char *chunk, int len) {
+    int i = 0;
+    while (i < len) {
+        recv_state_t before = m_ctx.state;
+        if (before == IPD_FRAME) {
+            i += parse_frame(chunk+i, len-i);
+        } else {
+            parse_byte(chunk[i++]);
+        }
+        if (m_ctx.state != before) {
+            trace(TR_RX_STATE, m_ctx.ipd_mux, m_ctx.state, m_ctx.iter);
+        }
+    }
+}
+
+/*
+ * Frame data is copied straight into the RX ring of the link behind its
+ * head and published once the whole frame is in, so frames of any length
+ * pass without going through m_ctx.buf. Returns the bytes consumed.
+ */
+int ESP8266::parse_frame(const char *data, int len) {
+    uint16_t n = m_ctx.ipd_length - m_ctx.ipd_got;
+    if (n > len) {
+        n = len;
+    }
+
+    if (!m_ctx.ipd_drop) {
+        connection_t *cn = &m_connects[m_ctx.ipd_mux];
+        char *ring = m_rx_data[m_ctx.ipd_mux];
+        uint16_t at = (uint16_t)(cn->rx_head + m_ctx.ipd_got) % ESP8266_RX_CAPACITY;
+        uint16_t first = ESP8266_RX_CAPACITY - at;
+        if (first > n) {
+            first = n;
+        }
+        memcpy(ring+at, data, first);
+        memcpy(ring, data+first, n-first);
+    }
+    m_ctx.ipd_got += n;
+    if (m_ctx.ipd_got < m_ctx.ipd_length) {
+        return n;
+    }
+
+    if (!m_ctx.ipd_drop) {
+        uint8_t mux = m_ctx.ipd_mux;
+        connection_t *cn = &m_connects[mux];
+        __atomic_store_n(&cn->rx_head, (uint16_t)(cn->rx_head + m_ctx.ipd_length), __ATOMIC_RELEASE);
+        ready_set(&m_ready, READY_RX(mux));
+        count(&m_counters.mux[mux].bytes_in, m_ctx.ipd_length);
+        count(&m_counters.mux[mux].frames_in);
+        trace(TR_RX_IPD, mux, m_ctx.state, m_ctx.ipd_length);
+        event_notify(&m_ctx.rx_event);
+    }
+    reset_rx_ctx();
+    return n;
+}
+
+/* TX_TAG() of the "AT+CIPSEND=<mux>,<len>" echo at the start of s, 0 if none */
+static uint32_t cipsend_echo(const char *s) {
+    if (strncmp(s, "AT+CIPSEND=", 11) != 0) {
+        return 0;
+    }
+    char *end;
+    unsigned long mux = strtoul(s + 11, &end, 10);
+    if (*end != ',' || mux >= MAX_MUX) {
+        return 0;
+    }
+    return TX_TAG(mux, strtoul(end + 1, NULL, 10));
+}
+
+/* Blank out CR and LF so a line logs on one line */
+static void blank_crlf(char *s) {
+    for (; *s; s++) {
+        if (*s == '\r' || *s == '\n') {
+            *s = ' ';
+        }
     }
-    //Console.printf("Console available \r\n", ctx.msg.data);
+}
+
+void ESP8266::parse_byte(char c) {
+    connection_t* cn = NULL;
+    char* parser = NULL;
 
     /* Overflow */
-    if (ctx.iter >= sizeof(ctx.buf)-1) {
-    Console.printf("    ctx reset?\r\n");
+    if (m_ctx.iter >= sizeof(m_ctx.buf)-1) {
+    logWarn("    ctx reset?\r\n");
+        count(&m_counters.parser_resets);
+        traceFault(TR_RX_RESET, 0, m_ctx.state, m_ctx.iter);
         reset_rx_ctx();
     }
 
-    c = m_puart->read();
-    ctx.buf[ctx.iter++] = c;
+    m_ctx.buf[m_ctx.iter++] = c;
 
-    switch (ctx.state) {
+    switch (m_ctx.state) {
         case NEW_CMD:
-            ctx.state = (c == '+' ? IPD_STATUS: STATUS);
-            if (ctx.state == IPD_MUX) {
+            m_ctx.state = (c == '+' ? IPD_STATUS: STATUS);
+            m_timers.arm(&m_rx_timer, ESP8266_RX_STALL_MS);
+            if (m_ctx.state == IPD_MUX) {
                // Console.printf("RX looking for IPD\r\n");
             }
             else {
@@ -886,151 +2097,169 @@ void ESP8266::super_recv(void) {
             break;
         case STATUS:
             //Console.printf("RX looking for new status\r\n");
-            // if (ctx.iter < 2) { goto done; }
-            if (ctx.iter < 2) {
+            // if (m_ctx.iter < 2) { goto done; }
+            if (m_ctx.iter < 2) {
                 goto done;
             }
 
-            if (strncmp(ctx.buf+ctx.iter-2, "> ", 2) == 0) {
-                Console.printf("GOT PROMPT FOR TX!!!! \r\n");
-                ctx_tx.lock.lock();
-                ctx_tx.state = TRANSMIT;
-                ctx_tx.lock.unlock();
+            if (strncmp(m_ctx.buf+m_ctx.iter-2, "> ", 2) == 0) {
+                logDebug("GOT PROMPT FOR TX!!!! \r\n");
+                m_ctx_tx.prompt_us = ESP8266Timer::nowUs();
+                m_ctx.buf[m_ctx.iter] = '\0';
+                m_ctx_tx.echo = cipsend_echo(m_ctx.buf);
+                __atomic_fetch_or(&m_ctx_tx.events, TX_EV_PROMPT, __ATOMIC_RELEASE);
+                trace(TR_RX_PROMPT, m_ctx_tx.mux_id, m_ctx.state, m_ctx.iter);
                 reset_rx_ctx();
                 break;
             }
 
-            if (strncmp(ctx.buf+ctx.iter-2, "\r\n", 2) != 0) {
+            if (strncmp(m_ctx.buf+m_ctx.iter-2, "\r\n", 2) != 0) {
                 goto done; 
             }
 
-            if (ctx.iter == 2 ) { reset_rx_ctx(); goto done; }
+            if (m_ctx.iter == 2 ) { reset_rx_ctx(); goto done; }
 
-            if (ctx.iter ==  9 && 0 == strncmp(ctx.buf, "SEND OK\r\n", 9)) {
-                Console.printf("Transfer complete!\r\n");
-                ctx_tx.lock.lock();
-                ctx_tx.state = TRANSMISSION_COMPLETE;
-                ctx_tx.lock.unlock();
+            if (m_ctx.iter ==  9 && 0 == strncmp(m_ctx.buf, "SEND OK\r\n", 9)) {
+                logDebug("Transfer complete!\r\n");
+                m_ctx_tx.result_us = ESP8266Timer::nowUs();
+                __atomic_fetch_or(&m_ctx_tx.events, TX_EV_SEND_OK, __ATOMIC_RELEASE);
+                trace(TR_RX_SEND_OK, m_ctx_tx.mux_id, m_ctx.state, m_ctx.iter);
             }
-            else if (ctx.iter == 11 && 0 == strncmp(ctx.buf, "SEND FAIL\r\n", 9))
+            else if (m_ctx.iter == 11 && 0 == strncmp(m_ctx.buf, "SEND FAIL\r\n", 9))
             {
-                Console.printf("Generic transmission failure!\r\n");
-                ctx_tx.lock.lock();
-                ctx_tx.state = TRANSMISSION_COMPLETE;
-                ctx_tx.failed = true;
-                strncpy(ctx_tx.reason, "Generic transmission failure", sizeof(ctx_tx.reason));
-                ctx_tx.lock.unlock();
+                logInfo("Generic transmission failure!\r\n");
+                m_ctx_tx.result_us = ESP8266Timer::nowUs();
+                __atomic_fetch_or(&m_ctx_tx.events, TX_EV_SEND_FAIL, __ATOMIC_RELEASE);
+                trace(TR_RX_SEND_FAIL, m_ctx_tx.mux_id, m_ctx.state, m_ctx.iter);
             }
-            else if (ctx.iter == 12 && 0 == strcmp(ctx.buf, "busy p....")) {
-                Console.printf("Transmission failure, chip busy!\r\n");
-                ctx_tx.lock.lock();
-                ctx_tx.state = TRANSMISSION_COMPLETE;
-                ctx_tx.failed = true;
-                strncpy(ctx_tx.reason, "Chip busy", sizeof(ctx_tx.reason));
-                ctx_tx.lock.unlock();
+            /* "busy p..." or "busy s...", the command wasn't taken */
+            else if (m_ctx.iter >= 7 && 0 == strncmp(m_ctx.buf, "busy ", 5)) {
+                logInfo("Transmission failure, chip busy!\r\n");
+                m_ctx_tx.result_us = ESP8266Timer::nowUs();
+                __atomic_fetch_or(&m_ctx_tx.events, TX_EV_BUSY, __ATOMIC_RELEASE);
+                trace(TR_RX_BUSY, m_ctx_tx.mux_id, m_ctx.state, m_ctx.iter);
             }
 
-            ctx.buf[ctx.iter] = '\0';
+            m_ctx.buf[m_ctx.iter] = '\0';
+
+            /* "<mux>,CONNECT" and "<mux>,CLOSED" track the links */
+            if (m_ctx.buf[0] >= '0' && m_ctx.buf[0] < '0' + MAX_MUX && m_ctx.buf[1] == ',') {
+                connection_t* link = &m_connects[m_ctx.buf[0] - '0'];
+                if (strcmp(m_ctx.buf+2, "CONNECT\r\n") == 0) {
+                    link->state = OPEN;
+                    trace(TR_RX_CONNECT, m_ctx.buf[0] - '0', m_ctx.state, m_ctx.iter);
+                } else if (strcmp(m_ctx.buf+2, "CLOSED\r\n") == 0) {
+                    link->state = CLOSED;
+                    trace(TR_RX_CLOSED, m_ctx.buf[0] - '0', m_ctx.state, m_ctx.iter);
+                }
+            }
 
-            if (ctx.buf[0] != 'A') {
-                *(strstr(ctx.buf, "\r"))=' ';
-                *(strstr(ctx.buf, "\n"))=' ';
-                Console.printf("RX last 0x%x statusLen: [%u]\r\n", ctx.buf[ctx.iter-2], strlen(ctx.buf));
-                Console.printf("   Status: [%s]\r\n", ctx.buf);
+            if (m_ctx.buf[0] != 'A') {
+                blank_crlf(m_ctx.buf);
+                logDebug("RX last 0x%x statusLen: [%u]\r\n", m_ctx.buf[m_ctx.iter-2], (unsigned)strlen(m_ctx.buf));
+                logDebug("   Status: [%s]\r\n", m_ctx.buf);
                 reset_rx_ctx();
                 break;
             }
 
-            if (ctx.iter-1 >= 11 && !strstr(ctx.buf, "AT+CIPSEND=")) {
+            if (m_ctx.iter-1 >= 11 && !strstr(m_ctx.buf, "AT+CIPSEND=")) {
                 reset_rx_ctx();
                 break;
             }
 
-            parser = strstr(ctx.buf, "\r\n\r\n");
+            parser = strstr(m_ctx.buf, "\r\n\r\n");
             if (!parser) {
                 goto done;
             }
 
             parser += 4;
-            if (parser == ctx.buf+ctx.iter) {
+            if (parser == m_ctx.buf+m_ctx.iter) {
                 goto done;
             }
-            *(strstr(parser, "\r"))=' ';
-            *(strstr(parser, "\n"))=' ';
+            blank_crlf(parser);
+            m_ctx_tx.echo = cipsend_echo(m_ctx.buf);
 
-            ctx_tx.lock.lock();
             if (strncmp(parser, "OK", 2) == 0) {
-                ctx_tx.failed = false;
+                __atomic_fetch_or(&m_ctx_tx.events, TX_EV_CIPSEND_OK, __ATOMIC_RELEASE);
+                trace(TR_RX_CIPSEND_OK, m_ctx_tx.mux_id, m_ctx.state, m_ctx.iter);
             }
-            else if (strstr(ctx.buf, "link is not valid") != 0) {
-                ctx_tx.failed = true;
-                strncpy(ctx_tx.reason, "link is not valid", sizeof(ctx_tx.reason));
+            else if (strstr(m_ctx.buf, "link is not valid") != 0) {
+                __atomic_fetch_or(&m_ctx_tx.events, TX_EV_LINK_INVALID, __ATOMIC_RELEASE);
+                trace(TR_RX_LINK_INVALID, m_ctx_tx.mux_id, m_ctx.state, m_ctx.iter);
                 reset_rx_ctx();
             }
             else {
-                ctx_tx.failed = true;
-                strncpy(ctx_tx.reason, "Generic transmission failure", sizeof(ctx_tx.reason));
+                __atomic_fetch_or(&m_ctx_tx.events, TX_EV_CIPSEND_FAIL, __ATOMIC_RELEASE);
+                trace(TR_RX_CIPSEND_FAIL, m_ctx_tx.mux_id, m_ctx.state, m_ctx.iter);
                 reset_rx_ctx();
             }
 
-            Console.printf("CIPSEND STATUS: [%s]\r\n", ctx.buf);
-            ctx_tx.lock.unlock();
+            logDebug("CIPSEND STATUS: [%s]\r\n", m_ctx.buf);
             goto done;
             break;
 
         case IPD_STATUS:
-            ctx.state = (c == 'I' ? IPD_MUX: STATUS);
+            m_ctx.state = (c == 'I' ? IPD_MUX: STATUS);
             break;
         case IPD_MUX:
-            if (ctx.iter-1 < (uint16_t)IPD_HEADER_LEN || c != ',') { goto done; }
-
-            ctx.ipd_mux_term_index = ctx.iter-1;
-            ctx.buf[ctx.iter] = '\0';
-
-            /*
-            Console.printf("RX looking for mux %s\r\n", ctx.buf);
-            Console.printf("    ctx.iter %x\r\n", ctx.iter);
-            Console.printf("    ipd.iter %x", IPD_HEADER_LEN);
-            */
-            ctx.buf[ctx.iter-1] = '\0';
-
-            ctx.ipd_mux = atoi(ctx.buf+IPD_HEADER_LEN);
+            /* The rest of "+IPD,", anything else is a status line */
+            if (m_ctx.iter <= IPD_HEADER_LEN) {
+                if (c != IPD_HEADER[m_ctx.iter-1]) {
+                    m_ctx.state = STATUS;
+                }
+                goto done;
+            }
 
-            //Console.printf("RX mux 0x%x vs %s\r\n", ctx.ipd_mux, ctx.buf+IPD_HEADER_LEN);
-            ctx.buf[ctx.iter-1] = c;
+            /* One digit of mux id then ',' */
+            if (c != ',') {
+                if (c < '0' || c > '9' || m_ctx.iter > IPD_HEADER_LEN+1) {
+                    goto malformed;
+                }
+                goto done;
+            }
+            if (m_ctx.iter == IPD_HEADER_LEN+1) {
+                goto malformed;
+            }
+            m_ctx.ipd_mux = m_ctx.buf[IPD_HEADER_LEN] - '0';
+            if (m_ctx.ipd_mux >= MAX_MUX) {
+                goto malformed;
+            }
 
-            ctx.state = IPD_LENGTH;
+            m_ctx.ipd_mux_term_index = m_ctx.iter-1;
+            m_ctx.ipd_length = 0;
+            m_ctx.state = IPD_LENGTH;
             break;
         case IPD_LENGTH:
-            if (c != ':') { goto done; }
-
-            ctx.buf[ctx.iter-1] = '\0';
-            ctx.ipd_length = atoi(ctx.buf+ctx.ipd_mux_term_index+1);
-//            Console.printf("RX length 0x%x vs %s\r\n", ctx.ipd_length, ctx.buf);
-            ctx.buf[ctx.iter-1] = c;
-
-            ctx.ipd_header_length = ctx.iter-1;
-            ctx.state = IPD_FRAME;
-            break;
-        case IPD_FRAME:
-            cn= &(GConnects[ctx.ipd_mux]);
-            if ((ctx.iter-1) - ctx.ipd_header_length < ctx.ipd_length) { 
-                //Console.printf("RX IPD_FRAME CXN {%d} READ BYTES {%d} expected {%d}\r\n", ctx.ipd_mux, (ctx.iter-1)-ctx.ipd_header_length, ctx.ipd_length);
-                goto done; 
+            if (c != ':') {
+                if (c < '0' || c > '9') {
+                    goto malformed;
+                }
+                m_ctx.ipd_length = m_ctx.ipd_length*10 + (c - '0');
+                if (m_ctx.ipd_length > IPD_FRAME_MAX) {
+                    goto malformed;
+                }
+                goto done;
+            }
+            if (m_ctx.ipd_length == 0) {
+                goto malformed;
             }
 
-            //Console.printf("RX RECV CXN {%d} LEN {%d}\r\n", ctx.ipd_mux, ctx.ipd_length);
-            //Console.printf("lock IPD %d\r\n", ctx.ipd_mux);
-            cn->lock.lock();
-            memcpy(cn->rx_data+cn->rx_len, ctx.buf+ctx.ipd_header_length+1, ctx.ipd_length);
-            cn->rx_len += ctx.ipd_length;
-            //Console.printf("RX MUX {%d} RECV MESSGE OF LEN {%d}\r\n", ctx.ipd_mux, cn->rx_len);
-            cn->lock.unlock();
-            //Console.printf("unlock IPD %d\r\n", ctx.ipd_mux);
-
+            /* Reserve the whole frame up front, parse_frame takes it from here */
+            cn = &(m_connects[m_ctx.ipd_mux]);
+            {
+                uint16_t space = ESP8266_RX_CAPACITY - rx_count(cn);
+                if (space < m_ctx.ipd_length) {
+                    logWarn("RX MUX {%d} full, dropping %d bytes\r\n", m_ctx.ipd_mux, m_ctx.ipd_length);
+                    count(&m_counters.mux[m_ctx.ipd_mux].frames_dropped);
+                    traceFault(TR_RX_DROP, m_ctx.ipd_mux, m_ctx.state, m_ctx.ipd_length);
+                    m_ctx.ipd_drop = true;
+                } else if (space == ESP8266_RX_CAPACITY) {
+                    m_rx_since[m_ctx.ipd_mux] = ESP8266Timer::nowUs();
+                }
+            }
 
-            //Console.printf("RX RECV CXN {%d} LEN {%d}\r\n", ctx.ipd_mux, ctx.ipd_length);
-            reset_rx_ctx();
+            m_ctx.ipd_got = 0;
+            m_ctx.state = IPD_FRAME;
             break;
 
         default:
@@ -1040,181 +2269,570 @@ void ESP8266::super_recv(void) {
 
 done:
     //Console.printf("EXIT super recv\r\n");
-    recv_state = ctx.state;
     return;
+
+malformed:
+    logWarn("RX bad +IPD header, %u bytes\r\n", (unsigned)m_ctx.iter);
+    count(&m_counters.malformed);
+    traceFault(TR_RX_MALFORMED, 0, m_ctx.state, m_ctx.iter);
+    reset_rx_ctx();
 }
 
 
-#define TX_CHUNK_LEN 512
+#define TX_EV_SETUP     (TX_EV_CIPSEND_OK | TX_EV_CIPSEND_FAIL | TX_EV_LINK_INVALID | TX_EV_PROMPT)
+#define TX_EV_RESULT    (TX_EV_SEND_OK | TX_EV_SEND_FAIL)
+
+/*
+ * Apply what the parser reported, in protocol order. A finding only counts
+ * in the state waiting for it, and a reply to AT+CIPSEND only if it echoes
+ * the request when echo is on, anything else (the result of a blocking send(), a reply
+ * after a timeout) is counted and dropped.
+ */
+void ESP8266::apply_tx_events(uint8_t events) {
+    uint8_t stale = 0;
+
+    /* The "> " of a CIPSEND that timed out, the module waits for that chunk */
+    if ((events & TX_EV_PROMPT) && m_ctx_tx.state == READY && m_ctx_tx.held
+        && (m_ctx_tx.echo == 0 || m_ctx_tx.echo == m_ctx_tx.held)) {
+        logInfo("TX late prompt, resuming\r\n");
+        m_ctx_tx.mux_id = m_ctx_tx.held >> 16;
+        m_ctx_tx.requested_tx_len = (uint16_t)m_ctx_tx.held;
+        m_ctx_tx.held = 0;
+        m_ctx_tx.state = WAIT_FOR_TRANSMISSION;
+        events &= ~(TX_EV_CIPSEND_OK | TX_EV_BUSY);
+    }
+
+    mux_counters_t *c = &m_counters.mux[m_ctx_tx.mux_id];
+
+    /* With echo off (ATE0) replies are untagged, only the state tells */
+    if (m_ctx_tx.state != WAIT_FOR_TRANSMISSION
+        || (m_ctx_tx.echo && m_ctx_tx.echo != TX_TAG(m_ctx_tx.mux_id, m_ctx_tx.requested_tx_len))) {
+        stale |= events & TX_EV_SETUP;
+    }
+    if (m_ctx_tx.state != WAIT_FOR_TRANSMISSION_RESULT) {
+        stale |= events & TX_EV_RESULT;
+    }
+    if (m_ctx_tx.state != WAIT_FOR_TRANSMISSION && m_ctx_tx.state != WAIT_FOR_TRANSMISSION_RESULT) {
+        stale |= events & TX_EV_BUSY;
+    }
+    if (stale) {
+        logInfo("TX dropped events 0x%x in state %d\r\n", stale, m_ctx_tx.state);
+        count(&m_counters.tx_unexpected);
+        trace(TR_TX_UNEXPECTED, m_ctx_tx.mux_id, m_ctx_tx.state, stale);
+        events &= ~stale;
+    }
+
+    if (events & TX_EV_CIPSEND_OK) {
+        m_ctx_tx.failed = false;
+    }
+    if (events & TX_EV_LINK_INVALID) {
+        m_ctx_tx.failed = true;
+        strncpy(m_ctx_tx.reason, "link is not valid", sizeof(m_ctx_tx.reason));
+    }
+    if (events & TX_EV_CIPSEND_FAIL) {
+        m_ctx_tx.failed = true;
+        strncpy(m_ctx_tx.reason, "Generic transmission failure", sizeof(m_ctx_tx.reason));
+    }
+    if (events & TX_EV_PROMPT) {
+        latency_record(&m_latency[LAT_PROMPT], m_ctx_tx.prompt_us - m_ctx_tx.last_write);
+        m_ctx_tx.state = TRANSMIT;
+    }
+    if ((events & (TX_EV_SEND_OK | TX_EV_SEND_FAIL | TX_EV_BUSY)) && m_ctx_tx.state == WAIT_FOR_TRANSMISSION_RESULT) {
+        latency_record(&m_latency[LAT_SEND], m_ctx_tx.result_us - m_ctx_tx.prompt_us);
+    }
+    if (events & TX_EV_SEND_OK) {
+        count(&c->send_ok);
+        m_ctx_tx.state = TRANSMISSION_COMPLETE;
+    }
+    if (events & TX_EV_SEND_FAIL) {
+        count(&c->send_fail);
+        m_ctx_tx.state = TRANSMISSION_COMPLETE;
+        m_ctx_tx.failed = true;
+        strncpy(m_ctx_tx.reason, "Generic transmission failure", sizeof(m_ctx_tx.reason));
+    }
+    if (events & TX_EV_BUSY) {
+        count(&c->busy);
+        /* Busy before the prompt: CIPSEND not taken, the chunk is set up again */
+        if (m_ctx_tx.state != WAIT_FOR_TRANSMISSION) {
+            m_ctx_tx.state = TRANSMISSION_COMPLETE;
+        }
+        m_ctx_tx.failed = true;
+        strncpy(m_ctx_tx.reason, "Chip busy", sizeof(m_ctx_tx.reason));
+    }
+}
+
 void ESP8266::stateful_tx(void) {
-    tx_iter = (tx_iter + 1) % 16;
-    Threads::Scope m(_lock);
-    Threads::Scope m_tx(ctx_tx.lock);
+    TimedScope m(_tx_lock, &m_counters.tx_lock_wait_us);
+    tx_state_t before = m_ctx_tx.state;
+
+    apply_tx_events(__atomic_exchange_n(&m_ctx_tx.events, 0, __ATOMIC_ACQUIRE));
 
-    if (ctx.state != NEW_CMD) {
+    /* Lock-free peek at the parser, don't start a CIPSEND in the middle of a frame */
+    if (__atomic_load_n(&m_ctx.state, __ATOMIC_RELAXED) != NEW_CMD) {
         //Console.printf("Reading command, give up on transmission\r\n");
+        if (m_ctx_tx.state != before) {
+            trace(TR_TX_STATE, m_ctx_tx.mux_id, m_ctx_tx.state, m_ctx_tx.requested_tx_len);
+        }
         return;
     }
 
     bool tx_necessary = false;
 
-    uint8_t mux_id = 0;
-    for (mux_id =0; mux_id < 5; mux_id++) {
-        connection_t* cxn = &GConnects[mux_id];
-        cxn->tx_lock.lock();
-        if (cxn->tx_len > 0) {
-            tx_necessary = true;
-            cxn->tx_lock.unlock();
-            break;
+    /* Round robin, a chunk at a time */
+    uint8_t mux_id = m_ctx_tx.mux_id;
+    if (m_ctx_tx.state == READY) {
+        /* After a prompt timeout hold off, a late "> " would take the next CIPSEND as data */
+        uint32_t ready = m_ctx_tx.held ? 0 : (ready_load(&m_ready) & READY_TX_ALL) >> 8;
+        for (uint8_t i = 1; ready && i <= MAX_MUX; i++) {
+            uint8_t next = (m_ctx_tx.last_mux + i) % MAX_MUX;
+            if (ready & (1UL << next)) {
+                mux_id = next;
+                tx_necessary = true;
+                break;
+            }
+        }
+    } else {
+        tx_necessary = tx_count(&m_connects[mux_id]) > 0;
+        /* The queue was cleared under the chunk (softReset), nothing to finish */
+        if (!tx_necessary) {
+            logWarn("TX state %d with an empty queue\r\n", m_ctx_tx.state);
+            reset_tx_ctx();
         }
-        cxn->tx_lock.unlock();
     }
 
     if (tx_necessary) {
-        connection_t* cxn = &GConnects[ctx_tx.mux_id];
+        connection_t* cxn = &m_connects[mux_id];
+        tx_seg_t* seg = &m_tx_ring[mux_id][cxn->tx_tail % TX_QUEUE_DEPTH];
         uint16_t remain= 0 ;
         uint16_t len = 0;
-        switch (ctx_tx.state) {
+        switch (m_ctx_tx.state) {
             case READY:
-                ctx_tx.mux_id = mux_id;
-                cxn = &GConnects[ctx_tx.mux_id];
-                cxn->tx_lock.lock();
-                len = cxn->tx_len < TX_CHUNK_LEN ? cxn->tx_len : TX_CHUNK_LEN;
-                cxn->tx_lock.unlock();
+                m_ctx_tx.mux_id = mux_id;
+                m_ctx_tx.last_mux = mux_id;
+                remain = seg->len - cxn->tx_wrote;
+                len = remain < m_tx_chunk ? remain : m_tx_chunk;
 
                 //Console.printf("*** TX data chunk %d..\n", len);
 
-                ctx_tx.requested_tx_len = len;
+                m_ctx_tx.requested_tx_len = len;
+                count(&m_counters.mux[mux_id].cipsend);
+                m_ctx_tx.last_write = ESP8266Timer::nowUs();
+                trace(TR_TX_CIPSEND, mux_id, m_ctx_tx.state, len);
                 setupTransmission(mux_id, len);
-                ctx_tx.state = WAIT_FOR_TRANSMISSION;
+                m_ctx_tx.state = WAIT_FOR_TRANSMISSION;
+                m_timers.arm(&m_tx_timer, ESP8266_TX_PROMPT_MS);
                 break;
 
             case TRANSMIT:
-                cxn->tx_lock.lock();
-                Console.printf("*** Attempt TX with offset %d!\r\n", ctx_tx.wrote);
-                if (ctx_tx.last_write != 0 || millis()+20 > ctx_tx.last_write ) {
-                    threads.yield();
-                }
-                if (!transmit(cxn->tx_data+ctx_tx.wrote, ctx_tx.requested_tx_len)) {
-                    cxn->tx_lock.unlock();
+                logDebug("*** Attempt TX with offset %d!\r\n", cxn->tx_wrote);
+                if (!transmit(seg->data+cxn->tx_wrote, m_ctx_tx.requested_tx_len)) {
                     break;
                 }
-                cxn->tx_lock.unlock();
-                ctx_tx.state = WAIT_FOR_TRANSMISSION_RESULT;
-                Console.printf("*** Attempt TX with offset %d complete, now wait!\r\n", ctx_tx.wrote);
+                m_ctx_tx.state = WAIT_FOR_TRANSMISSION_RESULT;
+                m_timers.arm(&m_tx_timer, ESP8266_TX_RESULT_MS);
+                trace(TR_TX_DATA, mux_id, m_ctx_tx.state, m_ctx_tx.requested_tx_len);
+                logDebug("*** Attempt TX with offset %d complete, now wait!\r\n", cxn->tx_wrote);
                 break;
 
             case TRANSMISSION_COMPLETE:
-                cxn->tx_lock.lock();
+                cxn->tx_wrote += m_ctx_tx.requested_tx_len;
+                remain = seg->len - cxn->tx_wrote;
 
-                cxn->seg_state = COMPLETE;
-                if (ctx_tx.failed) {
-                    Console.printf("FAILED TX %d bytes, reason: %s\r\n", ctx_tx.requested_tx_len, ctx_tx.reason);
+                /* A segment missing a chunk is lost, don't send the rest */
+                if (m_ctx_tx.failed) {
+                    logWarn("FAILED TX %d bytes, reason: %s\r\n", m_ctx_tx.requested_tx_len, m_ctx_tx.reason);
                     cxn->seg_state = FAILED;
+                    remain = 0;
+                    traceFault(TR_TX_CHUNK_FAIL, mux_id, m_ctx_tx.state, m_ctx_tx.requested_tx_len);
+                } else {
+                    count(&m_counters.mux[mux_id].bytes_out, m_ctx_tx.requested_tx_len);
+                    trace(TR_TX_CHUNK_OK, mux_id, m_ctx_tx.state, m_ctx_tx.requested_tx_len);
+                    if (remain == 0) {
+                        cxn->seg_state = COMPLETE;
+                        count(&m_counters.mux[mux_id].segments_out);
+                        latency_record(&m_latency[LAT_SEGMENT], ESP8266Timer::nowUs() - seg->queued_us);
+                    }
                 }
 
-                remain = cxn->tx_len - ctx_tx.requested_tx_len;
-                ctx_tx.wrote += ctx_tx.requested_tx_len;
-
-                //Console.printf("*** Moving %d bytes of data offset from..%d\n", remain, ctx_tx.requested_tx_len);
-                //memmove(cxn->tx_data, cxn->tx_data+ctx_tx.requested_tx_len, remain);
-                cxn->tx_len = remain;
                 if (remain == 0) {
-                    //Console.printf("*** Freeing data..\n");
-                    ctx_tx.wrote = 0;
-                    //free(cxn->tx_data);
+                    trace(TR_TX_SEGMENT, mux_id, m_ctx_tx.state, seg->len);
+                    cxn->tx_wrote = 0;
+                    __atomic_store_n(&cxn->tx_tail, (uint8_t)(cxn->tx_tail + 1), __ATOMIC_RELEASE);
+                    tx_settle(&m_ready, cxn, mux_id);
+                    event_notify(&m_ctx_tx.tx_event);
                 }
-                cxn->tx_lock.unlock();
 
-                //Console.printf("success TX %d bytes, buffer size: %d!\n", ctx_tx.requested_tx_len, cxn->tx_len);
+                //Console.printf("success TX %d bytes, buffer size: %d!\n", m_ctx_tx.requested_tx_len, remain);
                 reset_tx_ctx();
                 break;
 
             case WAIT_FOR_TRANSMISSION_RESULT:
             case WAIT_FOR_TRANSMISSION:
             default:
-            if (ctx_tx.failed) {
-                Console.printf("FAILED TX SETUP %d bytes, reason: %s\n", ctx_tx.requested_tx_len, ctx_tx.reason);
-                if (strstr(ctx_tx.reason, "link is not valid")) {
-                    ctx_tx.state = TRANSMISSION_COMPLETE;
+            if (m_ctx_tx.failed) {
+                logWarn("FAILED TX SETUP %d bytes, reason: %s\n", m_ctx_tx.requested_tx_len, m_ctx_tx.reason);
+                if (strstr(m_ctx_tx.reason, "link is not valid")) {
+                    m_ctx_tx.state = TRANSMISSION_COMPLETE;
                 }
                 else {
+                    count(&m_counters.mux[mux_id].retries);
+                    trace(TR_TX_RETRY, mux_id, m_ctx_tx.state, m_ctx_tx.requested_tx_len);
                     reset_tx_ctx();
                 }
             }
            break;
         }
     }
-    tx_state = ctx_tx.state;
+    if (m_ctx_tx.state != before) {
+        trace(TR_TX_STATE, m_ctx_tx.mux_id, m_ctx_tx.state, m_ctx_tx.requested_tx_len);
+    }
 }
 
 
+/*
+ * A timer that fired is only a hint, the owner may have moved on or armed
+ * it again before we got the lock. What was waiting when it was armed and
+ * still is, with the timer idle, timed out.
+ */
+void ESP8266::expire(uint32_t fired) {
+    if (fired & (1UL << TIMER_RX)) {
+        Threads::Scope m(_rx_lock);
+        if (m_ctx.state != NEW_CMD && !m_timers.armed(&m_rx_timer)) {
+            logWarn("RX stalled in state %d, %u bytes\r\n", m_ctx.state, (unsigned)m_ctx.iter);
+            count(&m_counters.rx_stalls);
+            traceFault(TR_RX_STALL, m_ctx.ipd_mux, m_ctx.state, m_ctx.iter);
+            reset_rx_ctx();
+        }
+    }
+
+    if (fired & (1UL << TIMER_TX)) {
+        Threads::Scope m(_tx_lock);
+        apply_tx_events(__atomic_exchange_n(&m_ctx_tx.events, 0, __ATOMIC_ACQUIRE));
+        if (m_timers.armed(&m_tx_timer)) {
+            return;
+        }
+        uint8_t mux_id = m_ctx_tx.mux_id;
+        if (m_ctx_tx.state == READY) {
+            /* The hold after a prompt timeout is over, the chunk is set up again */
+            if (m_ctx_tx.held) {
+                count(&m_counters.mux[m_ctx_tx.held >> 16].retries);
+                m_ctx_tx.held = 0;
+                event_notify(&m_ctx_tx.idle_event);
+            }
+        } else if (tx_count(&m_connects[mux_id]) == 0) {
+            /* The queue was cleared under the chunk (softReset), nothing to finish */
+            logWarn("TX state %d with an empty queue\r\n", m_ctx_tx.state);
+            reset_tx_ctx();
+        } else if (m_ctx_tx.state == WAIT_FOR_TRANSMISSION) {
+            /* No prompt, wait as long again for a late one before a new CIPSEND */
+            logWarn("TX no prompt for %d bytes\r\n", m_ctx_tx.requested_tx_len);
+            count(&m_counters.mux[mux_id].timeouts);
+            traceFault(TR_TX_TIMEOUT, mux_id, m_ctx_tx.state, m_ctx_tx.requested_tx_len);
+            uint32_t held = TX_TAG(mux_id, m_ctx_tx.requested_tx_len);
+            reset_tx_ctx();
+            m_ctx_tx.held = held;
+            m_timers.arm(&m_tx_timer, ESP8266_TX_PROMPT_MS);
+        } else if (m_ctx_tx.state == WAIT_FOR_TRANSMISSION_RESULT) {
+            /* No result, the chunk and so the segment are lost */
+            count(&m_counters.mux[mux_id].timeouts);
+            traceFault(TR_TX_TIMEOUT, mux_id, m_ctx_tx.state, m_ctx_tx.requested_tx_len);
+            m_ctx_tx.state = TRANSMISSION_COMPLETE;
+            m_ctx_tx.failed = true;
+            strncpy(m_ctx_tx.reason, "Timeout", sizeof(m_ctx_tx.reason));
+        }
+    }
+}
+
+#define PUMP_RX_BURST 4    /* of RX_CHUNK */
+
+bool ESP8266::pump(void) {
+    bool busy = false;
+
+    uint32_t fired = m_timers.poll();
+    if (fired) {
+        expire(fired);
+    }
+
+    for (int i = 0; i < PUMP_RX_BURST && m_puart->available() > 0; i++) {
+        super_recv();
+        busy = true;
+    }
+
+    stateful_tx();
+    if (m_ctx_tx.state != READY) {
+        busy = true;
+    }
+    if (ready_load(&m_ready) & READY_TX_ALL) {
+        busy = true;
+    }
+    return busy;
+}
+
+void ESP8266::pumpThread(void *arg) {
+    ESP8266 *esp = (ESP8266*)arg;
+    while (esp->m_pump_run) {
+        if (esp->pump()) {
+            threads.yield();
+        } else {
+            threads.delay(esp->m_pump_idle_sleep);
+        }
+    }
+}
+
+int ESP8266::start(int stack_size, int time_slice, uint8_t idle_sleep) {
+    if (m_pump_id >= 0) {
+        return -1;
+    }
+    if (m_bringup != BRINGUP_IDLE && m_bringup != BRINGUP_DONE && m_bringup != BRINGUP_FAILED) {
+        return -1;
+    }
+    m_pump_idle_sleep = idle_sleep;
+    m_pump_run = true;
+    m_pump_id = threads.addThread(pumpThread, this, stack_size);
+    if (m_pump_id < 0) {
+        m_pump_run = false;
+        return -1;
+    }
+    threads.setTimeSlice(m_pump_id, time_slice);
+    return m_pump_id;
+}
+
+void ESP8266::stop(void) {
+    if (m_pump_id < 0) {
+        return;
+    }
+    m_pump_run = false;
+    threads.wait(m_pump_id);
+    m_pump_id = -1;
+}
+
+/*
+ * Copy len bytes starting at index from out of an RX ring.
+ */
+static void ring_copy(char *dst, const char *data, uint16_t from, uint16_t len) {
+    uint16_t at = from % ESP8266_RX_CAPACITY;
+    uint16_t first = ESP8266_RX_CAPACITY - at;
+    if (first > len) {
+        first = len;
+    }
+    memcpy(dst, data+at, first);
+    memcpy(dst+first, data, len-first);
+}
+
 bool ESP8266::super_recv_mux_done(recv_msg_t* msg) {
-    bool ret = false;
-    for (int i =0; i < 5; i++) {
-        connection_t* cxn = &GConnects[i];
-        char* loc;
-        uint16_t  len;
-        uint16_t  remain;
-        cxn->lock.lock();
-        if (cxn->rx_len <= 0) { 
-            //Console.printf("Connection %d rx length is zero\r\n", i);
-            cxn->lock.unlock();
+    uint32_t ready = ready_load(&m_ready) & READY_RX_ALL;
+
+    for (int i =0; ready && i < MAX_MUX; i++) {
+        connection_t* cxn = &m_connects[i];
+        const char* data = m_rx_data[i];
+        uint16_t  tail;
+        uint16_t  count;
+        uint16_t  len = 0;
+        uint8_t   match = 0;
+        uint32_t  now;
+
+        if (!(ready & READY_RX(i))) {
+            continue;
+        }
+        ready &= ~READY_RX(i);
+        /* Another thread is consuming this mux */
+        if (__atomic_exchange_n(&cxn->rx_claim, 1, __ATOMIC_ACQUIRE)) {
             continue;
         }
-        //Console.printf("Processing request on Connection %d\r\n", i);
-
-        cxn->rx_data[cxn->rx_len] = '\0';
-        loc = strstr(cxn->rx_data, "\r\n\r\n");
-        if (loc == NULL ) { 
-            Console.printf("Couldn't find HTTP terminator.. %s\r\n", cxn->rx_data);
-            Console.printf("rx_data[len-8] %c %x\r\n", cxn->rx_data[cxn->rx_len-8], cxn->rx_data[cxn->rx_len-8]);
-            Console.printf("rx_data[len-7] %c %x\r\n", cxn->rx_data[cxn->rx_len-7], cxn->rx_data[cxn->rx_len-7]);
-            Console.printf("rx_data[len-6] %c %x\r\n", cxn->rx_data[cxn->rx_len-6], cxn->rx_data[cxn->rx_len-6]);
-            Console.printf("rx_data[len-5] %c %x\r\n", cxn->rx_data[cxn->rx_len-5], cxn->rx_data[cxn->rx_len-5]);
-            Console.printf("rx_data[len-4] %c %x\r\n", cxn->rx_data[cxn->rx_len-4], cxn->rx_data[cxn->rx_len-4]);
-            Console.printf("rx_data[len-3] %c %x\r\n", cxn->rx_data[cxn->rx_len-3], cxn->rx_data[cxn->rx_len-3]);
-            Console.printf("rx_data[len-2] %c %x\r\n", cxn->rx_data[cxn->rx_len-2], cxn->rx_data[cxn->rx_len-2]);
-            Console.printf("rx_data[len-1] %c %x\r\n", cxn->rx_data[cxn->rx_len-1], cxn->rx_data[cxn->rx_len-1]);
-            Console.printf("rx_data[len] %c %x\r\n"  , cxn->rx_data[cxn->rx_len], cxn->rx_data[cxn->rx_len]);
-            cxn->rx_len = 0;
-            cxn->lock.unlock();
+
+        tail = cxn->rx_tail;
+        count = rx_count(cxn);
+        if (count == 0) {
+            rx_settle(&m_ready, cxn, i);
+            __atomic_store_n(&cxn->rx_claim, 0, __ATOMIC_RELEASE);
             continue;
         }
+        while (len < count && match < 4) {
+            char c = data[(uint16_t)(tail + len) % ESP8266_RX_CAPACITY];
+            len++;
+            if (c == "\r\n\r\n"[match]) {
+                match++;
+            } else {
+                match = (c == '\r') ? 1 : 0;
+            }
+        }
 
-        ret = true;
-        len  = loc+4-cxn->rx_data;
-        memcpy(msg->data, cxn->rx_data, len);
+        if (match < 4 || len > sizeof(msg->data)) {
+            uint16_t shown = len < sizeof(msg->data) ? len : sizeof(msg->data)-1;
+            ring_copy(msg->data, data, tail, shown);
+            msg->data[shown] = '\0';
+            if (match < 4) {
+                logWarn("Couldn't find HTTP terminator.. %s\r\n", msg->data);
+            } else {
+                logWarn("Request of %d bytes too long.. %s\r\n", len, msg->data);
+            }
+            for (int k = 8; k >= 1; k--) {
+                char c = shown >= k ? msg->data[shown-k] : 0;
+                logDebug("rx_data[len-%d] %c %x\r\n", k, c, c);
+            }
+            if (match == 4 && len < count) {
+                m_rx_since[i] = ESP8266Timer::nowUs();
+            }
+            __atomic_store_n(&cxn->rx_tail, (uint16_t)(tail + (match < 4 ? count : len)), __ATOMIC_RELEASE);
+            rx_settle(&m_ready, cxn, i);
+            __atomic_store_n(&cxn->rx_claim, 0, __ATOMIC_RELEASE);
+            continue;
+        }
+
+        ring_copy(msg->data, data, tail, len);
+        now = ESP8266Timer::nowUs();
+        latency_record(&m_latency[LAT_PICKUP], now - m_rx_since[i]);
         msg->len = len;
         msg->mux = i;
 
-        remain = cxn->rx_len -len;
-        if (remain > 0) {
-            memmove(cxn->rx_data, cxn->rx_data+len, remain);
+        /*
+         * What is left came in after the frame the stamp was taken for, time
+         * it from now. The parser only stamps an empty ring, so this is
+         * written before the tail lets it see one.
+         */
+        if (len < count) {
+            m_rx_since[i] = now;
         }
-        cxn->rx_len = remain;
-        //Console.printf("Connection[%d] rx_len {%d} vs calculated len {%d} \r\n", i, cxn->rx_len, len);
-        cxn->lock.unlock();
-        return ret;
+        __atomic_store_n(&cxn->rx_tail, (uint16_t)(tail + len), __ATOMIC_RELEASE);
+        rx_settle(&m_ready, cxn, i);
+        //Console.printf("Connection[%d] rx remain {%d} vs calculated len {%d} \r\n", i, count-len, len);
+        __atomic_store_n(&cxn->rx_claim, 0, __ATOMIC_RELEASE);
+        return true;
     }
-    return ret;
+    return false;
 }
 
-String ESP8266::runCommand(const char* cmd) {
-    unsigned long start = millis();
+recv_msg_t ESP8266::s_msg_arena[ESP8266_MSG_SLOTS];
+volatile uint8_t ESP8266::s_msg_refs[ESP8266_MSG_SLOTS];
+
+recv_msg_t *ESP8266::msgAlloc(void) {
+    for (uint8_t i = 0; i < ESP8266_MSG_SLOTS; i++) {
+        uint8_t free_refs = 0;
+        if (__atomic_compare_exchange_n(&s_msg_refs[i], &free_refs, 1, false,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            return &s_msg_arena[i];
+        }
+    }
+    return NULL;
+}
+
+recv_msg_t *ESP8266::recvTake(void) {
+    /* Peek first so idle polling doesn't churn the arena */
+    if (!(ready_load(&m_ready) & READY_RX_ALL)) {
+        return NULL;
+    }
+    recv_msg_t *msg = msgAlloc();
+    if (msg == NULL) {
+        return NULL;
+    }
+    if (!super_recv_mux_done(msg)) {
+        recvRelease(msg);
+        return NULL;
+    }
+    return msg;
+}
 
-    while (millis() - start < 5000) {
-        _lock.lock();
-        if (ctx.state == NEW_CMD && ctx_tx.state == READY) {
+void ESP8266::recvRetain(recv_msg_t *msg) {
+    __atomic_fetch_add(&s_msg_refs[msg - s_msg_arena], 1, __ATOMIC_RELAXED);
+}
+
+void ESP8266::recvRelease(recv_msg_t *msg) {
+    __atomic_fetch_sub(&s_msg_refs[msg - s_msg_arena], 1, __ATOMIC_RELEASE);
+}
+
+uint8_t ESP8266::recvInUse(void) {
+    uint8_t used = 0;
+    for (uint8_t i = 0; i < ESP8266_MSG_SLOTS; i++) {
+        if (__atomic_load_n(&s_msg_refs[i], __ATOMIC_RELAXED)) {
+            used++;
+        }
+    }
+    return used;
+}
+
+bool ESP8266::waitRx(uint8_t mux_id, uint32_t timeout) {
+    unsigned long start = ESP8266Timer::nowMs();
+    uint32_t seen;
+    do {
+        seen = event_sample(&m_ctx.rx_event);
+        if (ready_load(&m_ready) & (mux_id == MUX_ANY ? READY_RX_ALL : READY_RX(mux_id))) {
+            return true;
+        }
+    } while (event_wait(&m_ctx.rx_event, seen, start, timeout));
+    return false;
+}
+
+bool ESP8266::waitTxSpace(uint8_t mux_id, uint32_t timeout) {
+    unsigned long start = ESP8266Timer::nowMs();
+    uint32_t seen;
+    do {
+        seen = event_sample(&m_ctx_tx.tx_event);
+        if (queueAvail(mux_id)) {
+            return true;
+        }
+    } while (event_wait(&m_ctx_tx.tx_event, seen, start, timeout));
+    return false;
+}
+
+bool ESP8266::waitSegment(uint8_t mux_id, uint32_t timeout) {
+    unsigned long start = ESP8266Timer::nowMs();
+    uint32_t seen;
+    do {
+        seen = event_sample(&m_ctx_tx.tx_event);
+        if (tx_count(&m_connects[mux_id]) == 0) {
+            return true;
+        }
+    } while (event_wait(&m_ctx_tx.tx_event, seen, start, timeout));
+    return false;
+}
+
+bool ESP8266::waitCommandIdle(uint32_t timeout) {
+    unsigned long start = ESP8266Timer::nowMs();
+    uint32_t seen;
+    do {
+        seen = event_sample(&m_ctx_tx.idle_event);
+        if (__atomic_load_n(&m_ctx.state, __ATOMIC_RELAXED) == NEW_CMD && m_ctx_tx.state == READY
+            && !m_ctx_tx.held) {
+            return true;
+        }
+    } while (event_wait(&m_ctx_tx.idle_event, seen, start, timeout));
+    return false;
+}
+
+/*
+ * Take the UART for an AT command, _rx_lock then _tx_lock, once the
+ * parser and TX are between frames and chunks or after 5 s regardless.
+ */
+void ESP8266::commandLock(void) {
+    unsigned long start = ESP8266Timer::nowMs();
+
+    while (true) {
+        uint32_t seen = event_sample(&m_ctx_tx.idle_event);
+        _rx_lock.lock();
+        _tx_lock.lock();
+        if (m_ctx.state == NEW_CMD && m_ctx_tx.state == READY && !m_ctx_tx.held) {
+            break;
+        }
+        _tx_lock.unlock();
+        _rx_lock.unlock();
+        if (!event_wait(&m_ctx_tx.idle_event, seen, start, 5000)) {
+            _rx_lock.lock();
+            _tx_lock.lock();
             break;
         }
-        _lock.unlock();
     }
+}
 
+void ESP8266::commandUnlock(void) {
+    _tx_lock.unlock();
+    _rx_lock.unlock();
+}
+
+String ESP8266::runCommand(const char* cmd) {
+    commandLock();
     m_puart->println(cmd);
     String ret = recvString("OK\r\n");
-
-    _lock.unlock();
-    Console.printf("AT COMMAND COMPLETE!\r\n");
+    commandUnlock();
+    logDebug("AT COMMAND COMPLETE!\r\n");
     return ret;
 }
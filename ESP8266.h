@@ -21,9 +21,9 @@
 #ifndef __ESP8266_H__
 #define __ESP8266_H__
 
-#include "Arduino.h"
-#include "TeensyThreads.h"
-#include <console.h>
+#include "ESP8266_hal.h"
+#include "ESP8266_config.h"
+#include "ESP8266Timer.h"
 
 
 //#define ESP8266_USE_SOFTWARE_SERIAL
@@ -34,7 +34,7 @@
 #endif
 
 typedef struct {
-    char data[1024];
+    char data[ESP8266_MSG_CAPACITY];
     uint16_t len;
     uint8_t done;
     uint8_t mux;
@@ -53,27 +53,329 @@ typedef enum {
     FAILED      = 3,
 } seg_state_t;
 
+#define TX_QUEUE_DEPTH ESP8266_TX_QUEUE_DEPTH
+#define MUX_ANY 0xFF
+
+typedef struct {
+    const char *data;
+    uint16_t len;
+    uint32_t queued_us;     /* micros() of queue() */
+} tx_seg_t;
+
+/*
+ * Both handoffs are single-producer/single-consumer rings with free running
+ * indices, each index is only written by its own side.
+ *
+ * Only the ring indices and link state live here, the ring storage is kept
+ * in separate arrays so a scan over every link touches one compact table
+ * instead of striding over the receive buffers.
+ */
 typedef struct {
-    char rx_data[1024];
-    char* tx_data;
+    /* Filled by the parser, drained by super_recv_mux_done */
+    volatile uint16_t rx_head;
+    volatile uint16_t rx_tail;
 
-    uint16_t rx_len;
-    uint16_t tx_len;
+    /* Filled by queue(), one thread per mux, drained by stateful_tx */
+    volatile uint8_t tx_head;
+    volatile uint8_t tx_tail;
+    uint16_t tx_wrote;          /* of the segment at tx_tail */
 
-    Threads::Mutex lock;
-    Threads::Mutex tx_lock;
-    cxn_state_t state;
-    seg_state_t seg_state;
+    volatile uint8_t rx_claim;  /* one consumer thread at a time */
+    volatile uint8_t state;     /* cxn_state_t */
+    volatile uint8_t seg_state; /* seg_state_t */
 } connection_t;
 
+/*
+ * Ready mask bits, set by the producer after publishing and cleared by the
+ * consumer when it drains the ring.
+ */
+#define READY_RX(mux) (1UL << (mux))
+#define READY_TX(mux) (1UL << ((mux) + 8))
+#define READY_RX_ALL  ((1UL << MAX_MUX) - 1)
+#define READY_TX_ALL  (READY_RX_ALL << 8)
+
+/*
+ * Counters of one link.
+ */
+typedef struct {
+    uint32_t bytes_in;      /* +IPD data queued for the application */
+    uint32_t frames_in;
+    uint32_t frames_dropped; /* +IPD frames that didn't fit the RX ring */
+    uint32_t bytes_out;     /* acknowledged by SEND OK */
+    uint32_t segments_out;
+    uint32_t cipsend;       /* chunks started */
+    uint32_t send_ok;
+    uint32_t send_fail;
+    uint32_t busy;
+    uint32_t retries;       /* chunks set up again after a failed CIPSEND */
+    uint32_t timeouts;      /* chunks that got no prompt or no result in time */
+} mux_counters_t;
+
+/*
+ * Counters of one ESP8266, see ESP8266::getCounters().
+ */
+typedef struct {
+    mux_counters_t mux[ESP8266_MAX_MUX];
+    uint32_t parser_resets;   /* line longer than the parser buffer */
+    uint32_t malformed;       /* +IPD headers with a bad mux id or length */
+    uint32_t rx_stalls;       /* lines or frames that didn't finish in time */
+    uint32_t tx_unexpected;   /* prompts and results no TX state waited for */
+    uint32_t rx_discarded;    /* bytes thrown away by rx_empty */
+    uint32_t uart_overruns;   /* receive ring found full */
+    uint32_t rx_lock_wait_us; /* time spent waiting for _rx_lock */
+    uint32_t tx_lock_wait_us; /* time spent waiting for _tx_lock */
+} counters_t;
+
+/*
+ * Latencies measured by the RX and TX engines.
+ */
+typedef enum {
+    LAT_PROMPT  = 0,    /* AT+CIPSEND to "> " */
+    LAT_SEND    = 1,    /* "> " to SEND OK/FAIL */
+    LAT_SEGMENT = 2,    /* queue() to the segment completing */
+    LAT_PICKUP  = 3,    /* oldest queued +IPD to super_recv_mux_done taking a request */
+    LAT_KINDS   = 4,
+} latency_kind_t;
+
+#define LAT_BUCKETS 24
+
+/*
+ * Log2 histogram in microseconds, bucket 0 holds 0 us, bucket i holds
+ * [2^(i-1), 2^i) us, the last bucket everything above.
+ */
+typedef struct {
+    uint32_t bucket[LAT_BUCKETS];
+    uint32_t count;
+    uint32_t max_us;
+} latency_hist_t;
+
+/*
+ * Trace events. TR_RX_* come from the parser, TR_TX_* from stateful_tx.
+ */
+typedef enum {
+    TR_RX_STATE         = 0x01, /* parser state changed, len = bytes in line */
+    TR_RX_IPD           = 0x02, /* +IPD frame queued, len = data bytes */
+    TR_RX_DROP          = 0x03, /* +IPD frame didn't fit the RX ring */
+    TR_RX_RESET         = 0x04, /* line longer than the parser buffer */
+    TR_RX_PROMPT        = 0x05,
+    TR_RX_SEND_OK       = 0x06,
+    TR_RX_SEND_FAIL     = 0x07,
+    TR_RX_BUSY          = 0x08,
+    TR_RX_CIPSEND_OK    = 0x09,
+    TR_RX_CIPSEND_FAIL  = 0x0A,
+    TR_RX_LINK_INVALID  = 0x0B,
+    TR_RX_CONNECT       = 0x0C,
+    TR_RX_CLOSED        = 0x0D,
+    TR_RX_MALFORMED     = 0x0E, /* +IPD header rejected, len = bytes in line */
+    TR_RX_STALL         = 0x0F, /* line or frame timed out, len = bytes in line */
+    TR_TX_STATE         = 0x20, /* TX state changed, len = chunk */
+    TR_TX_CIPSEND       = 0x21, /* len = chunk */
+    TR_TX_DATA          = 0x22, /* chunk written, len = chunk */
+    TR_TX_CHUNK_OK      = 0x23,
+    TR_TX_CHUNK_FAIL    = 0x24,
+    TR_TX_RETRY         = 0x25,
+    TR_TX_SEGMENT       = 0x26, /* segment left the queue, len = segment */
+    TR_TX_TIMEOUT       = 0x27, /* no prompt or no result, len = chunk */
+    TR_TX_UNEXPECTED    = 0x28, /* findings no state waited for, len = TX_EV_* bits */
+} trace_event_t;
+
+/*
+ * One trace record, 8 bytes little endian as dumped by traceDump().
+ */
+typedef struct {
+    uint32_t us;        /* micros() */
+    uint16_t len;
+    uint8_t event;      /* trace_event_t */
+    uint8_t info;       /* mux << 4 | parser or TX state */
+} trace_rec_t;
+
+#define TRACE_DUMP_MAGIC "E8TR"
+
+/*
+ * Capture record types, see ESP8266::captureStart().
+ */
+typedef enum {
+    CAP_RX      = 0,    /* bytes super_recv read from the UART */
+    CAP_TX      = 1,    /* bytes stateful_tx wrote to the UART */
+    CAP_QUEUE   = 2,    /* segment given to queue() */
+} capture_type_t;
+
+/*
+ * Header of a capture record, little endian, len bytes follow.
+ */
+typedef struct {
+    uint32_t us;        /* micros() */
+    uint8_t type;       /* capture_type_t */
+    uint8_t mux;
+    uint16_t len;
+} capture_hdr_t;
+
+#define CAPTURE_MAGIC "E8CP"
+
+typedef enum {
+    BRINGUP_IDLE        = 0,
+    BRINGUP_RESET       = 1,
+    BRINGUP_WAIT_READY  = 2,
+    BRINGUP_KICK        = 3,
+    BRINGUP_QUERY_MODE  = 4,
+    BRINGUP_SET_MODE    = 5,
+    BRINGUP_QUERY_AP    = 6,
+    BRINGUP_JOIN_AP     = 7,
+    BRINGUP_DONE        = 8,
+    BRINGUP_FAILED      = 9,
+} bringup_state_t;
+
+/*
+ * Response of an AT command issued without blocking the caller.
+ */
+typedef struct {
+    char resp[160];
+    uint16_t len;
+    uint32_t start;
+    uint32_t timeout;
+} at_pending_t;
+
+/*
+ * Optional AT commands found by probeCapabilities(). Only what some code
+ * path picks by is probed: CIPSENDEX, CIPSENDBUF and CIPRECVMODE have no
+ * TX or RX engine here, so bits 0 - 4 are unused.
+ */
+typedef enum {
+    CAP_UART_CUR    = (1 << 5),
+    CAP_PROBED      = (1UL << 31),
+} capability_t;
+
+typedef enum {
+    CFG_MODE            = 0,    /* value: operation mode (1 - 3)                    */
+    CFG_MUX             = 1,    /* value: 0 - single, 1 - multiple connections      */
+    CFG_SERVER_TIMEOUT  = 2,    /* value: seconds                                   */
+    CFG_SERVER          = 3,    /* value: port to listen on, 0 stops the server     */
+    CFG_DHCP            = 4,    /* value: mode (0 - softap, 1 - station, 2 - both), arg: enabled */
+    CFG_SOFTAP          = 5,    /* ssid, pwd, value: channel, arg: encryption       */
+    CFG_KEYS
+} config_key_t;
+
+typedef enum {
+    CFG_PENDING = 0,
+    CFG_APPLIED,
+    CFG_SKIPPED,    /* already in effect */
+    CFG_FAILED,
+} config_result_t;
+
+/*
+ * One setting of a configure() batch.
+ */
+typedef struct {
+    config_key_t key;
+    uint32_t value;
+    uint8_t arg;
+    const char *ssid;
+    const char *pwd;
+    config_result_t result;
+} config_item_t;
+
+/*
+ * Where the last association landed. Owned by the caller so it can be kept
+ * across power cycles (EEPROM, RTC memory, ...).
+ */
+typedef struct {
+    char bssid[18];     /* "aa:bb:cc:dd:ee:ff" */
+    uint8_t channel;
+    uint8_t valid;
+} ap_cache_t;
+
+#include "ESP8266_private.h"
+
 /**
  * Provide an easy-to-use way to manipulate ESP8266. 
+ *
+ * All parser, TX and connection state lives in the instance, several
+ * modules can be driven at once, each on its own UART. 
  */
 class ESP8266 {
  public:
 
     bool SpecialBaud();
+
+    /**
+     * Switch ESP8266 and the UART to another baud rate. 
+     *
+     * The module is moved with "AT+UART_CUR", then the UART follows and the
+     * link is verified with a series of "AT" round trips. If any probe is
+     * lost or garbled, both sides are moved back to the previous rate and
+     * flow control. 
+     *
+     * The RTS of ESP8266 (flow 1) is watched through the cts_pin of the
+     * UART, its CTS (flow 2) is driven by the rts_pin, a flow needing a
+     * pin that wasn't given is refused. 
+     *
+     * @param baud - the new baud rate, e.g. 921600 or 2000000. 
+     * @param flow - flow control of ESP8266 (0 - none, 1 - RTS, 2 - CTS, 3 - RTS and CTS, default: 2). 
+     * @retval true - the new rate is in use.
+     * @retval false - failure, the previous rate is in use. 
+     */
+    bool setBaud(uint32_t baud, uint8_t flow = 2);
+
+    /**
+     * Try a list of baud rates in order and keep the first one that verifies. 
+     *
+     * @param rates - candidate baud rates, fastest first. 
+     * @param count - number of candidates. 
+     * @param flow - flow control of ESP8266, see setBaud. 
+     * @retval true - one of the rates is in use.
+     * @retval false - none verified, the previous rate is in use. 
+     */
+    bool negotiateBaud(const uint32_t *rates, uint8_t count, uint8_t flow = 2);
+
+    /**
+     * Get the baud rate currently used with ESP8266. 
+     */
+    uint32_t getBaud(void);
+
+    /**
+     * Get the number of failed probes of the last verification. 
+     */
+    uint16_t getBaudErrors(void);
+
+    /**
+     * Get the number of times a rate was abandoned for the previous one. 
+     */
+    uint16_t getBaudFallbacks(void);
+
     void stateful_tx();
+
+    /**
+     * Start a thread pumping super_recv() and stateful_tx(). 
+     *
+     * The thread drains the UART in bursts, advances the TX state machine
+     * in between and sleeps while the UART and the TX queues are idle.
+     * TeensyThreads has no priorities, a longer time slice is what gives
+     * the pump precedence. 
+     *
+     * @param stack_size - stack of the thread in bytes (default: 2048). 
+     * @param time_slice - time slice of the thread in ticks (default: 10). 
+     * @param idle_sleep - milliseconds to sleep when idle (default: 1). 
+     * @return the thread id, -1 on failure, if already started or while
+     *         a beginBringup() sequence runs. 
+     */
+    int start(int stack_size = 2048, int time_slice = 10, uint8_t idle_sleep = 1);
+
+    /**
+     * Stop the thread started by start() and wait for it to exit. 
+     */
+    void stop(void);
+
+    /**
+     * Drain up to a burst of received bytes and advance TX once. 
+     *
+     * This is what the thread of start() runs, for callers pumping from
+     * their own loop. It also expires the parser and TX deadlines, see
+     * ESP8266_RX_STALL_MS and ESP8266_TX_PROMPT_MS/ESP8266_TX_RESULT_MS. 
+     *
+     * @retval true - there was work to do.
+     * @retval false - idle.
+     */
+    bool pump(void);
     bool queue(uint8_t mux_id, const uint8_t *buffer, uint32_t len);
     bool queueAvail(uint8_t mux_id);
     bool setupTransmission(uint8_t mux_id, uint32_t len);
@@ -96,10 +398,12 @@ class ESP8266 {
      *
      * @param uart - an reference of HardwareSerial object. 
      * @param baud - the buad rate to communicate with ESP8266(default:9600). 
+     * @param rts_pin - the RTS pin of uart attached by restart(), -1 for none(default:19, Serial2). 
+     * @param cts_pin - the CTS pin of uart attached by setBaud() with flow 1 or 3, -1 for none(default). 
      *
      * @warning parameter baud depends on the AT firmware. 9600 is an common value. 
      */
-    ESP8266(HardwareSerial &uart, uint32_t baud = 9600);
+    ESP8266(HardwareSerial &uart, uint32_t baud = 9600, int8_t rts_pin = 19, int8_t cts_pin = -1);
 #endif
     
     
@@ -116,19 +420,111 @@ class ESP8266 {
     /**
      * Restart ESP8266 by "AT+RST". 
      *
-     * This method will take 3 seconds or more. 
+     * This method returns once the module printed its "ready" banner and
+     * answers "AT", usually within a second. 
      *
      * @retval true - success.
      * @retval false - failure.
      */
     bool restart(void);
+
+    /**
+     * Start bringing ESP8266 up without blocking the caller.
+     *
+     * The sequence is: optional "AT+RST" (waiting for the "ready" boot banner
+     * rather than fixed delays), "AT", operation mode and, if ssid is given,
+     * joining the AP. Mode and AP steps are skipped when the module already
+     * reports the requested configuration. Drive it with pollBringup().
+     *
+     * The steps read and write the UART between calls without holding the
+     * engine locks, so the sequence only runs while the pump thread of
+     * start() is stopped, and start() refuses to run during it.
+     *
+     * @param mode - operation mode (1 - station, 2 - softap, 3 - both).
+     * @param ssid - SSID of AP to join in, NULL to stay unassociated.
+     * @param pwd - Password of AP to join in.
+     * @param reset - restart the module first (default: true).
+     * @param cache - association cache used and refreshed like joinAP does (default: NULL).
+     * @retval true - sequence started.
+     * @retval false - a sequence is already running or the pump is started.
+     */
+    bool beginBringup(uint8_t mode, const char *ssid = NULL, const char *pwd = NULL, bool reset = true,
+                      ap_cache_t *cache = NULL);
+
+    /**
+     * Advance the bring-up sequence. Only consumes what the UART already holds.
+     *
+     * @return the state after this step, BRINGUP_DONE or BRINGUP_FAILED when finished.
+     */
+    bringup_state_t pollBringup(void);
+
+    /**
+     * Get the state of the bring-up sequence.
+     */
+    bringup_state_t getBringupState(void);
+
+    /**
+     * Get the duration of the bring-up sequence in milliseconds, up to now
+     * while it is still running.
+     */
+    uint32_t getBringupTime(void);
     
+    /**
+     * Apply a batch of settings. 
+     *
+     * Every kind of setting in the batch is queried once, items already in
+     * effect are marked CFG_SKIPPED and the rest are issued in order, each
+     * right after the previous command completed. Holds the UART like
+     * runCommand() for the whole batch, so it runs alongside the pump. 
+     *
+     * @param items - the settings, result of each is filled in. 
+     * @param count - number of items. 
+     * @retval true - no item failed.
+     * @retval false - at least one item is CFG_FAILED.
+     */
+    bool configure(config_item_t *items, uint8_t count);
+
     /**
      * Get the version of AT Command Set. 
      * 
      * @return the string of version. 
      */
     String getVersion(void);
+
+    /**
+     * Find out what the AT firmware supports. 
+     *
+     * Parses the "AT version" of "AT+GMR" and probes AT+UART_CUR with its
+     * query form, nothing is set. The version selects the CIPSEND chunk
+     * length, the probe the baud rate command. Call it while no link is
+     * open. 
+     *
+     * @return the capability_t bitmask, CAP_PROBED set once probed. 
+     */
+    uint32_t probeCapabilities(void);
+
+    /**
+     * Get the capability_t bitmask of the last probeCapabilities(). 
+     */
+    uint32_t getCapabilities(void);
+
+    /**
+     * Get the AT version as (major << 8 | minor), 0 if unknown. 
+     */
+    uint16_t getATVersion(void);
+
+    /**
+     * Set the largest chunk stateful_tx() sends per AT+CIPSEND. 
+     *
+     * probeCapabilities() picks ESP8266_TX_CHUNK_MAX when the firmware
+     * takes it, ESP8266_TX_CHUNK_LEN otherwise. 
+     *
+     * @param len - 1 - ESP8266_TX_CHUNK_MAX. 
+     * @retval true - set.
+     * @retval false - out of range.
+     */
+    bool setTxChunk(uint16_t len);
+    uint16_t getTxChunk(void);
     
     /**
      * Set operation mode to staion. 
@@ -173,6 +569,22 @@ class ESP8266 {
      * @note This method will take a couple of seconds. 
      */
     bool joinAP(String ssid, String pwd);
+
+    /**
+     * Join in AP, pinned to the BSSID of the last successful association. 
+     *
+     * When cache is valid the join is restricted to the cached BSSID, which
+     * avoids a full scan. If that fails the cache is invalidated and a plain
+     * join is made. After any successful join the cache is refreshed from
+     * "AT+CWJAP?". 
+     *
+     * @param ssid - SSID of AP to join in. 
+     * @param pwd - Password of AP to join in. 
+     * @param cache - association cache, kept by the caller. 
+     * @retval true - success.
+     * @retval false - failure.
+     */
+    bool joinAP(String ssid, String pwd, ap_cache_t *cache);
     
     
     /**
@@ -429,10 +841,186 @@ class ESP8266 {
      */
     uint32_t recv(uint8_t mux_id, uint8_t *buffer, uint32_t buffer_size, uint32_t timeout = 1000);
 
+    /**
+     * Parse what the UART received, up to a chunk of 64 bytes per call. 
+     */
     void super_recv();
     bool super_recv_done(recv_msg_t*);
+
+    /**
+     * Parse bytes as if super_recv() had read them from the UART. 
+     *
+     * For replaying a capture, see ESP8266Replay.
+     *
+     * @param data - the bytes.
+     * @param len - number of bytes.
+     */
+    void feed(const char *data, size_t len);
+
+#ifdef ESP8266_HOST
+    /**
+     * Check the bounds of the parser buffer and the rings and the link ids
+     * the engines hold, for the fuzz target in extras/fuzz.
+     *
+     * @return NULL if they hold, else the one that doesn't.
+     */
+    const char *checkInvariants(void);
+#endif
+
+    /**
+     * Record the traffic of the RX and TX engines.
+     *
+     * Writes CAPTURE_MAGIC then a capture_hdr_t record for every chunk
+     * super_recv() reads, every CIPSEND and chunk stateful_tx() writes and
+     * every segment given to queue(). AT commands outside the engines are
+     * not recorded. The sink is written from the pump and application
+     * threads under a lock of its own, it must be fast enough not to
+     * overrun the UART (a RAM buffer, not the USB serial at full load). 
+     *
+     * @param sink - where to write, NULL stops.
+     */
+    void captureStart(Print *sink);
+    void captureStop(void);
+
+    /**
+     * Give the UART a large receive ring. 
+     *
+     * The UART interrupt deposits every received byte straight into this
+     * ring, so bytes survive while the parser isn't scheduled (long TX
+     * bursts, busy threads). super_recv() drains it in chunks. The Teensy
+     * core has no RX DMA, the interrupt is the fastest path there is. 
+     *
+     * @param buffer - memory of the ring, must outlive this object. 
+     * @param size - size of buffer in bytes. 
+     * @retval true - attached.
+     * @retval false - not supported (SoftwareSerial, Teensyduino before 1.48). 
+     */
+    bool attachRxBuffer(void *buffer, size_t size);
+
+    /**
+     * Get how many times super_recv() found the receive ring full, i.e. the
+     * UART interrupt probably had to drop bytes. Only counted once
+     * attachRxBuffer() told the ring size. 
+     */
+    uint32_t getRxOverruns(void);
+
+    /**
+     * Copy the counters of this object.
+     *
+     * The copy is taken holding both locks, so the RX and TX counters agree
+     * with each other. Counters wrap at 2^32.
+     *
+     * @param out - the copy.
+     */
+    void getCounters(counters_t *out);
+
+    /**
+     * Clear all counters.
+     */
+    void resetCounters(void);
+
+    /**
+     * Get a percentile of a latency.
+     *
+     * Resolution is the histogram bucket, the upper bound of the bucket is
+     * returned, capped to the largest latency seen.
+     *
+     * @param kind - which latency.
+     * @param percentile - 1 - 100.
+     * @return the latency in microseconds, 0 if nothing was recorded.
+     */
+    uint32_t getLatency(latency_kind_t kind, uint8_t percentile);
+
+    /**
+     * Copy the histogram of a latency.
+     *
+     * @param kind - which latency.
+     * @param out - the copy.
+     */
+    void getLatencyHistogram(latency_kind_t kind, latency_hist_t *out);
+
+    /**
+     * Clear all latency histograms.
+     */
+    void resetLatency(void);
+
+    /**
+     * Copy the newest trace records, oldest first.
+     *
+     * Recording is lock free and never waits, a record being written while
+     * it is copied may come out mixed. Call traceFreeze() first for a
+     * stable copy.
+     *
+     * @param out - the records.
+     * @param max - room in out.
+     * @return the number of records copied.
+     */
+    uint16_t traceRead(trace_rec_t *out, uint16_t max);
+
+    /**
+     * Write the trace in binary: TRACE_DUMP_MAGIC, a uint16_t record count,
+     * a uint16_t record size, then the records as by traceRead().
+     *
+     * @param out - e.g. Serial or a File.
+     * @return the number of records written.
+     */
+    uint16_t traceDump(Print &out);
+
+    /**
+     * Stop recording, e.g. to keep the events leading up to a fault.
+     */
+    void traceFreeze(void);
+
+    /**
+     * Resume recording.
+     *
+     * @param clear - drop the records so far.
+     */
+    void traceResume(bool clear = false);
+
+    /**
+     * Freeze the trace by itself on a dropped frame, parser reset or failed
+     * chunk.
+     *
+     * @param enable - freeze on fault.
+     */
+    void traceFreezeOnFault(bool enable);
+
+    /**
+     * Get whether recording is stopped.
+     */
+    bool traceFrozen(void);
     bool super_recv_mux_done(recv_msg_t* msg);
 
+    /**
+     * Take a complete request as a message of the shared arena.
+     *
+     * The arena holds ESP8266_MSG_SLOTS messages shared by every instance,
+     * so worker threads don't each need a recv_msg_t of their own. The
+     * message comes with one reference, hand it on with recvRetain() and
+     * give every reference back with recvRelease().
+     *
+     * @return the message, NULL if nothing is complete or the arena is
+     *  exhausted (the request then stays queued on its link).
+     */
+    recv_msg_t *recvTake(void);
+
+    /**
+     * Add a reference to a message of recvTake().
+     */
+    static void recvRetain(recv_msg_t *msg);
+
+    /**
+     * Drop a reference to a message of recvTake(), the last one returns
+     * the message to the arena.
+     */
+    static void recvRelease(recv_msg_t *msg);
+
+    /**
+     * Get the number of arena messages currently referenced.
+     */
+    static uint8_t recvInUse(void);
+
     /**
      * Receive data from all of TCP or UDP builded already in multiple mode. 
      *
@@ -450,8 +1038,95 @@ class ESP8266 {
     String runCommand(const char* cmd);
     seg_state_t getTransferState(uint8_t mux);
 
+    /**
+     * Get whether a link is open, as reported by "<mux_id>,CONNECT" and
+     * "<mux_id>,CLOSED" or set by createTCP/releaseTCP. 
+     *
+     * @param mux_id - the identifier of this TCP(available value: 0 - 4). 
+     */
+    cxn_state_t getLinkState(uint8_t mux_id);
+
+    /**
+     * Get the number of segments queued and not yet sent on a link. 
+     *
+     * @param mux_id - the identifier of this TCP(available value: 0 - 4). 
+     */
+    uint8_t getQueued(uint8_t mux_id);
+
+    /**
+     * Sleep until received data is waiting on a connection. 
+     *
+     * Waiters yield to other threads until the parser signals, they don't
+     * spin on queueAvail() style polling. 
+     *
+     * @param mux_id - the identifier of the connection, MUX_ANY for any. 
+     * @param timeout - the time waiting in milliseconds. 
+     * @retval true - data is available.
+     * @retval false - timeout.
+     */
+    bool waitRx(uint8_t mux_id, uint32_t timeout);
+
+    /**
+     * Sleep until queue() has room on a connection. 
+     *
+     * @param mux_id - the identifier of the connection. 
+     * @param timeout - the time waiting in milliseconds. 
+     * @retval true - queueAvail(mux_id) is true.
+     * @retval false - timeout.
+     */
+    bool waitTxSpace(uint8_t mux_id, uint32_t timeout);
+
+    /**
+     * Sleep until every segment queued on a connection completed or failed. 
+     *
+     * @param mux_id - the identifier of the connection. 
+     * @param timeout - the time waiting in milliseconds. 
+     * @retval true - nothing is queued, getTransferState(mux_id) has the last result.
+     * @retval false - timeout.
+     */
+    bool waitSegment(uint8_t mux_id, uint32_t timeout);
+
+    /**
+     * Sleep until neither a frame is being parsed nor a CIPSEND is in flight,
+     * i.e. an AT command can be issued. 
+     *
+     * @param timeout - the time waiting in milliseconds. 
+     * @retval true - idle.
+     * @retval false - timeout.
+     */
+    bool waitCommandIdle(uint32_t timeout);
+
  private:
-      Threads::Mutex _lock;
+    /*
+     * Lock hierarchy, take them in this order and never upwards:
+     *   1. _rx_lock - UART reads and the parser context (super_recv).
+     *   2. _tx_lock - UART writes and the TX context (stateful_tx).
+     * RX and TX run in parallel, the parser only talks to TX through the
+     * lock-free tx_ctx_t::events and to the application through the
+     * connection_t rings. AT commands own the UART both ways and take 1
+     * then 2. The bring-up sequence can't hold them across its steps and
+     * only runs while the pump is stopped.
+     * _cap_lock only serializes writes to the capture sink and is taken
+     * last.
+     */
+    Threads::Mutex _rx_lock;
+    Threads::Mutex _tx_lock;
+    Threads::Mutex _cap_lock;
+
+    static void pumpThread(void *arg);
+    static recv_msg_t *msgAlloc(void);
+
+    static recv_msg_t s_msg_arena[ESP8266_MSG_SLOTS];
+    static volatile uint8_t s_msg_refs[ESP8266_MSG_SLOTS];
+
+    void init(uint32_t baud);
+    void reset_rx_ctx(void);
+    void reset_tx_ctx(void);
+    void reset_tx_ctx_failed(uint8_t mux);
+    void set_tx_ctx_failed(uint8_t mux);
+    void apply_tx_events(uint8_t events);
+    void parse_byte(char c);
+    void expire(uint32_t fired);
 
 
     /* 
@@ -503,7 +1178,9 @@ class ESP8266 {
     
     bool qATCWMODE(uint8_t *mode);
     bool sATCWMODE(uint8_t mode);
-    bool sATCWJAP(String ssid, String pwd);
+    bool sATCWJAP(String ssid, String pwd, const char *bssid = NULL, uint32_t timeout = 10000);
+    bool qATCWJAP(String ssid, ap_cache_t *cache);
+    bool parseAPCache(const char *cwjap, String ssid, ap_cache_t *cache);
     bool sATCWDHCP(uint8_t mode, boolean enabled);
     bool eATCWLAP(String &list);
     bool eATCWQAP(void);
@@ -522,6 +1199,76 @@ class ESP8266 {
     bool sATCIPMUX(uint8_t mode);
     bool sATCIPSERVER(uint8_t mode, uint32_t port = 333);
     bool sATCIPSTO(uint32_t timeout);
+    bool sATUARTCUR(uint32_t baud, uint8_t flow);
+    bool probeCommand(const char *cmd);
+
+    /*
+     * Send "AT" count times and return the number of replies lost or garbled.
+     */
+    uint16_t probeBaud(uint8_t count);
+
+    /*
+     * Put the UART on the flow control of ESP8266, attaching the pins the
+     * flow needs and detaching the others. False if a pin is missing.
+     */
+    bool attachFlow(uint8_t flow);
+
+    /*
+     * Issue cmd (NULL to only wait for data) and return at once, the response
+     * is collected by pendingPoll.
+     */
+    void pendingSend(const char *cmd, uint32_t timeout);
+
+    /*
+     * Collect available response bytes. Return 1, 2 or 3 for the target found,
+     * 0 while still waiting and -1 on timeout.
+     */
+    int8_t pendingPoll(const char *target1, const char *target2 = NULL, const char *target3 = NULL);
+
+    /*
+     * pendingSend and wait for pendingPoll to finish.
+     */
+    int8_t commandWait(const char *cmd, uint32_t timeout, const char *target1,
+                       const char *target2 = NULL, const char *target3 = NULL);
+    bool configInEffect(const config_item_t *item, const char *current);
+    String configCommand(const config_item_t *item);
+    uint8_t dhcpBits(uint8_t mode);
+    String dhcpCommand(uint8_t mode, bool enabled);
+    void commandLock(void);
+    void commandUnlock(void);
+
+    void parse_chunk(const char *chunk, int len);
+    int parse_frame(const char *data, int len);
+    void capture(uint8_t type, uint8_t mux, const void *data, uint16_t len);
+
+    void trace(uint8_t event, uint8_t mux, uint8_t state, uint16_t len);
+    void traceFault(uint8_t event, uint8_t mux, uint8_t state, uint16_t len);
+
+    void bringupFinish(bringup_state_t state);
+    void bringupAfterMode(void);
+
+    volatile bool m_pump_run;
+    int m_pump_id;
+    uint8_t m_pump_idle_sleep;
+
+    uint32_t m_caps;
+    uint16_t m_at_version;
+    uint16_t m_tx_chunk;
+
+    uint32_t m_baud;
+    uint16_t m_baud_errors;
+    uint16_t m_baud_fallbacks;
+
+    at_pending_t m_pending;
+    bringup_state_t m_bringup;
+    uint8_t m_bringup_mode;
+    uint8_t m_bringup_retries;
+    uint32_t m_bringup_start;
+    uint32_t m_bringup_time;
+    bool m_bringup_joined;
+    ap_cache_t *m_bringup_cache;
+    String m_bringup_ssid;
+    String m_bringup_pwd;
 
     /*
      * +IPD,len:data
@@ -533,7 +1280,37 @@ class ESP8266 {
 #else
     HardwareSerial *m_puart; /* The UART to communicate with ESP8266 */
 #endif
+    int8_t m_rts_pin;
+    int8_t m_cts_pin;
+    uint8_t m_flow;     /* flow control of the current baud rate */
+
+    recv_ctx_t m_ctx;
+    tx_ctx_t m_ctx_tx;
+    connection_t m_connects[MAX_MUX];
+    volatile uint32_t m_ready;  /* READY_RX/READY_TX bits */
+    tx_seg_t m_tx_ring[MAX_MUX][TX_QUEUE_DEPTH];
+    char m_rx_data[MAX_MUX][ESP8266_RX_CAPACITY];
+    uint32_t m_rx_capacity;
+    counters_t m_counters;
+    latency_hist_t m_latency[LAT_KINDS];
+    uint32_t m_rx_since[MAX_MUX];   /* micros() the oldest queued +IPD frame arrived */
+
+#if ESP8266_TRACE_DEPTH
+    trace_rec_t m_trace[ESP8266_TRACE_DEPTH];
+#endif
+    Print * volatile m_capture;
+
+    ESP8266Timer m_timers;
+    timer_node_t m_rx_timer;    /* parser left NEW_CMD */
+    timer_node_t m_tx_timer;    /* prompt or result of the chunk in flight */
+
+    volatile uint32_t m_trace_head;     /* free running, records reserved */
+    volatile uint8_t m_trace_frozen;
+    bool m_trace_on_fault;
 };
 
+static_assert(sizeof(ESP8266) <= ESP8266_RAM_BUDGET,
+              "ESP8266 exceeds ESP8266_RAM_BUDGET, see ESP8266_config.h");
+
 #endif /* #ifndef __ESP8266_H__ */
 
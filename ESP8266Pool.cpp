@@ -0,0 +1,188 @@
+/**
+ * @file ESP8266Pool.cpp
+ * @brief The implementation of class ESP8266Pool.
+ *
+ * @par Copyright:
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version. \n\n
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include "ESP8266Pool.h"
+
+ESP8266Pool::ESP8266Pool(ESP8266 **modules, uint8_t count)
+{
+    m_count = count < POOL_MAX_MODULES ? count : POOL_MAX_MODULES;
+    for (uint8_t i = 0; i < m_count; i++) {
+        m_modules[i] = modules[i];
+    }
+    m_recv_next = 0;
+    memset(m_reserved, 0, sizeof(m_reserved));
+}
+
+bool ESP8266Pool::start(int stack_size, int time_slice, uint8_t idle_sleep)
+{
+    bool ret = true;
+    for (uint8_t i = 0; i < m_count; i++) {
+        if (m_modules[i]->start(stack_size, time_slice, idle_sleep) < 0) {
+            ret = false;
+        }
+    }
+    return ret;
+}
+
+int16_t ESP8266Pool::createTCP(String addr, uint32_t port)
+{
+    uint8_t tried = 0;
+
+    while (true) {
+        int16_t best = -1;
+        uint8_t mux_id = 0;
+        {
+            /* Pick and reserve a link, the connect runs without the lock */
+            Threads::Scope m(m_lock);
+            uint16_t best_load = 0xFFFF;
+            for (uint8_t i = 0; i < m_count; i++) {
+                uint8_t links = 0;
+                for (uint8_t k = 0; k < MAX_MUX; k++) {
+                    if (m_modules[i]->getLinkState(k) != CLOSED || (m_reserved[i] & (1 << k))) {
+                        links++;
+                    }
+                }
+                if ((tried & (1 << i)) || links >= MAX_MUX) {
+                    continue;
+                }
+                uint16_t load = (links << 8) | getQueued(i);
+                if (load < best_load) {
+                    best_load = load;
+                    best = i;
+                }
+            }
+            if (best < 0) {
+                return -1;
+            }
+            while (mux_id < MAX_MUX
+                   && (m_modules[best]->getLinkState(mux_id) != CLOSED || (m_reserved[best] & (1 << mux_id)))) {
+                mux_id++;
+            }
+            /* A link opened from the far side since it was counted */
+            if (mux_id >= MAX_MUX) {
+                tried |= 1 << best;
+                continue;
+            }
+            m_reserved[best] |= 1 << mux_id;
+        }
+
+        bool ok = m_modules[best]->createTCP(mux_id, addr, port);
+        {
+            Threads::Scope m(m_lock);
+            m_reserved[best] &= ~(1 << mux_id);
+        }
+        if (ok) {
+            return best * MAX_MUX + mux_id;
+        }
+        /* The module may be the problem, not the host, try the next one */
+        tried |= 1 << best;
+    }
+}
+
+bool ESP8266Pool::releaseTCP(uint8_t id)
+{
+    if (id >= m_count * MAX_MUX) {
+        return false;
+    }
+    return m_modules[id / MAX_MUX]->releaseTCP(id % MAX_MUX);
+}
+
+bool ESP8266Pool::queue(uint8_t id, const uint8_t *buffer, uint32_t len)
+{
+    if (id >= m_count * MAX_MUX) {
+        return false;
+    }
+    return m_modules[id / MAX_MUX]->queue(id % MAX_MUX, buffer, len);
+}
+
+bool ESP8266Pool::queueAvail(uint8_t id)
+{
+    if (id >= m_count * MAX_MUX) {
+        return false;
+    }
+    return m_modules[id / MAX_MUX]->queueAvail(id % MAX_MUX);
+}
+
+seg_state_t ESP8266Pool::getTransferState(uint8_t id)
+{
+    if (id >= m_count * MAX_MUX) {
+        return FAILED;
+    }
+    return m_modules[id / MAX_MUX]->getTransferState(id % MAX_MUX);
+}
+
+bool ESP8266Pool::recv(recv_msg_t *msg)
+{
+    for (uint8_t i = 0; i < m_count; i++) {
+        uint8_t index = (m_recv_next + i) % m_count;
+        if (m_modules[index]->super_recv_mux_done(msg)) {
+            msg->mux += index * MAX_MUX;
+            m_recv_next = (index + 1) % m_count;
+            return true;
+        }
+    }
+    return false;
+}
+
+recv_msg_t *ESP8266Pool::recvTake(void)
+{
+    for (uint8_t i = 0; i < m_count; i++) {
+        uint8_t index = (m_recv_next + i) % m_count;
+        recv_msg_t *msg = m_modules[index]->recvTake();
+        if (msg) {
+            msg->mux += index * MAX_MUX;
+            m_recv_next = (index + 1) % m_count;
+            return msg;
+        }
+    }
+    return NULL;
+}
+
+uint8_t ESP8266Pool::getModuleCount(void)
+{
+    return m_count;
+}
+
+ESP8266 *ESP8266Pool::getModule(uint8_t index)
+{
+    return index < m_count ? m_modules[index] : NULL;
+}
+
+uint8_t ESP8266Pool::getLinks(uint8_t index)
+{
+    uint8_t links = 0;
+    for (uint8_t mux_id = 0; mux_id < MAX_MUX; mux_id++) {
+        if (m_modules[index]->getLinkState(mux_id) == OPEN) {
+            links++;
+        }
+    }
+    return links;
+}
+
+uint8_t ESP8266Pool::getQueued(uint8_t index)
+{
+    uint8_t queued = 0;
+    for (uint8_t mux_id = 0; mux_id < MAX_MUX; mux_id++) {
+        queued += m_modules[index]->getQueued(mux_id);
+    }
+    return queued;
+}
+
+uint8_t ESP8266Pool::getUtilization(uint8_t index)
+{
+    return getLinks(index) * 100 / MAX_MUX;
+}
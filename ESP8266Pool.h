@@ -0,0 +1,120 @@
+/**
+ * @file ESP8266Pool.h
+ * @brief The definition of class ESP8266Pool.
+ *
+ * @par Copyright:
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version. \n\n
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef __ESP8266_POOL_H__
+#define __ESP8266_POOL_H__
+
+#include "ESP8266.h"
+
+#define POOL_MAX_MODULES 4
+
+/**
+ * Spread connections over several ESP8266 modules.
+ *
+ * A connection is identified by id = module * MAX_MUX + mux_id, so the
+ * application sees one id space of POOL_MAX_MODULES * MAX_MUX links.
+ * New outbound connections go to the module with the fewest open links,
+ * ties are broken by the number of queued segments.
+ */
+class ESP8266Pool {
+ public:
+    /*
+     * Constructor.
+     *
+     * @param modules - the modules, already brought up in multiple mode.
+     * @param count - number of modules (at most POOL_MAX_MODULES).
+     */
+    ESP8266Pool(ESP8266 **modules, uint8_t count);
+
+    /**
+     * Start the pump thread of every module, see ESP8266::start().
+     *
+     * @retval true - all started.
+     * @retval false - at least one failed.
+     */
+    bool start(int stack_size = 2048, int time_slice = 10, uint8_t idle_sleep = 1);
+
+    /**
+     * Create a TCP connection on the least loaded module, or the next least
+     * loaded one if the connect fails there. Safe to call from several threads.
+     *
+     * @param addr - the IP or domain name of the target host.
+     * @param port - the port number of the target host.
+     * @return the connection id, -1 if no module has a free link or the connection failed on all.
+     */
+    int16_t createTCP(String addr, uint32_t port);
+
+    /**
+     * Release a connection.
+     *
+     * @param id - the connection id.
+     */
+    bool releaseTCP(uint8_t id);
+
+    /**
+     * Queue a segment on a connection, see ESP8266::queue().
+     */
+    bool queue(uint8_t id, const uint8_t *buffer, uint32_t len);
+    bool queueAvail(uint8_t id);
+    seg_state_t getTransferState(uint8_t id);
+
+    /**
+     * Take a complete request from any module, msg->mux is the connection id.
+     *
+     * Modules are visited round robin so a busy one can't starve the others.
+     *
+     * @retval true - msg is filled in.
+     * @retval false - nothing complete.
+     */
+    bool recv(recv_msg_t *msg);
+
+    /**
+     * Take a complete request from any module as a message of the shared
+     * arena, see ESP8266::recvTake(). msg->mux is the connection id.
+     *
+     * @return the message, release it with ESP8266::recvRelease(). NULL if
+     *  nothing is complete or the arena is exhausted.
+     */
+    recv_msg_t *recvTake(void);
+
+    uint8_t getModuleCount(void);
+    ESP8266 *getModule(uint8_t index);
+
+    /**
+     * Get the number of open links of a module.
+     */
+    uint8_t getLinks(uint8_t index);
+
+    /**
+     * Get the number of segments queued on a module.
+     */
+    uint8_t getQueued(uint8_t index);
+
+    /**
+     * Get the share of the links of a module in use, in percent.
+     */
+    uint8_t getUtilization(uint8_t index);
+
+ private:
+    ESP8266 *m_modules[POOL_MAX_MODULES];
+    uint8_t m_count;
+    uint8_t m_recv_next;
+    Threads::Mutex m_lock;                      /* guards m_reserved */
+    uint8_t m_reserved[POOL_MAX_MODULES];       /* per module, bits of links being connected */
+};
+
+#endif /* #ifndef __ESP8266_POOL_H__ */
@@ -0,0 +1,223 @@
+/**
+ * @file ESP8266Replay.cpp
+ * @brief The implementation of class ESP8266Replay.
+ *
+ * @par Copyright:
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version. \n\n
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include "ESP8266Replay.h"
+
+#define REPLAY_TX_CALLS 64  /* stateful_tx calls at most per drainTx */
+#define REPLAY_TICK_US  1000    /* clock steps between records */
+
+uint64_t ESP8266Replay::s_now;
+
+uint64_t ESP8266Replay::clock(void)
+{
+    return __atomic_load_n(&s_now, __ATOMIC_ACQUIRE);
+}
+
+ESP8266Replay::ESP8266Replay(ESP8266 &esp, const uint8_t *capture, size_t len)
+{
+    m_esp = &esp;
+    m_capture = capture;
+    m_len = len;
+    m_pos = valid() ? 4 : len;
+    m_exp_pos = m_pos;
+    m_exp_off = 0;
+
+    m_hdr_len = 0;
+    m_skip_magic = 4;
+    m_rec_type = 0;
+    m_rec_left = 0;
+
+    m_tx_bytes = 0;
+    m_tx_mismatches = 0;
+    m_first_mismatch = -1;
+
+    /* Start at the time of the first record */
+    capture_hdr_t hdr;
+    m_last_us = 0;
+    if (m_pos + sizeof(hdr) <= m_len) {
+        memcpy(&hdr, m_capture + m_pos, sizeof(hdr));
+        m_last_us = hdr.us;
+    }
+    __atomic_store_n(&s_now, (uint64_t)m_last_us, __ATOMIC_RELEASE);
+    ESP8266Timer::setClock(clock);
+
+    m_esp->captureStart(this);
+}
+
+ESP8266Replay::~ESP8266Replay()
+{
+    m_esp->captureStop();
+    ESP8266Timer::setClock(NULL);
+}
+
+bool ESP8266Replay::valid(void)
+{
+    return m_len >= 4 && memcmp(m_capture, CAPTURE_MAGIC, 4) == 0;
+}
+
+bool ESP8266Replay::step(void)
+{
+    capture_hdr_t hdr;
+
+    if (m_pos + sizeof(hdr) > m_len) {
+        return false;
+    }
+    memcpy(&hdr, m_capture + m_pos, sizeof(hdr));
+    if (m_pos + sizeof(hdr) + hdr.len > m_len) {
+        m_pos = m_len;
+        return false;
+    }
+
+    advance(hdr.us);
+
+    const uint8_t *data = m_capture + m_pos + sizeof(hdr);
+    switch (hdr.type) {
+        case CAP_RX:
+            drainTx();
+            m_esp->feed((const char*)data, hdr.len);
+            break;
+        case CAP_QUEUE:
+            /* It had room when captured, let TX catch up */
+            for (int i = 0; i < REPLAY_TX_CALLS && !m_esp->queueAvail(hdr.mux); i++) {
+                drainTx();
+            }
+            m_esp->queue(hdr.mux, data, hdr.len);
+            break;
+        case CAP_TX:
+        default:
+            break;
+    }
+    m_pos += sizeof(hdr) + hdr.len;
+    return true;
+}
+
+uint32_t ESP8266Replay::run(void)
+{
+    uint32_t records = 0;
+    while (step()) {
+        records++;
+    }
+    drainTx();
+    return records;
+}
+
+uint32_t ESP8266Replay::getTxBytes(void)
+{
+    return m_tx_bytes;
+}
+
+uint32_t ESP8266Replay::getTxMismatches(void)
+{
+    return m_tx_mismatches;
+}
+
+int32_t ESP8266Replay::getFirstMismatch(void)
+{
+    return m_first_mismatch;
+}
+
+/*
+ * Run stateful_tx until two calls in a row write nothing, i.e. it waits
+ * for the module.
+ */
+void ESP8266Replay::drainTx(void)
+{
+    uint8_t idle = 0;
+    for (int i = 0; i < REPLAY_TX_CALLS && idle < 2; i++) {
+        uint32_t before = m_tx_bytes;
+        m_esp->stateful_tx();
+        idle = (m_tx_bytes == before) ? idle + 1 : 0;
+    }
+}
+
+/*
+ * Move the clock to the time of a record, micros() wraps so only the
+ * difference to the last one counts. It moves a millisecond at a time
+ * with a pump() each, so a timer fires when it did and what it arms
+ * (the hold after a prompt timeout) runs from there.
+ */
+void ESP8266Replay::advance(uint32_t us)
+{
+    int32_t delta = (int32_t)(us - m_last_us);
+    m_last_us = us;
+    while (delta > 0) {
+        int32_t step = delta < REPLAY_TICK_US ? delta : REPLAY_TICK_US;
+        __atomic_fetch_add(&s_now, (uint64_t)step, __ATOMIC_RELEASE);
+        m_esp->pump();
+        delta -= step;
+    }
+}
+
+int ESP8266Replay::nextExpected(void)
+{
+    capture_hdr_t hdr;
+
+    while (m_exp_pos + sizeof(hdr) <= m_len) {
+        memcpy(&hdr, m_capture + m_exp_pos, sizeof(hdr));
+        if (hdr.type == CAP_TX && m_exp_off < hdr.len
+            && m_exp_pos + sizeof(hdr) + m_exp_off < m_len) {
+            return m_capture[m_exp_pos + sizeof(hdr) + m_exp_off++];
+        }
+        m_exp_pos += sizeof(hdr) + hdr.len;
+        m_exp_off = 0;
+    }
+    return -1;
+}
+
+size_t ESP8266Replay::write(uint8_t c)
+{
+    if (m_skip_magic) {
+        m_skip_magic--;
+        return 1;
+    }
+
+    if (m_hdr_len < sizeof(m_hdr)) {
+        m_hdr[m_hdr_len++] = c;
+        if (m_hdr_len == sizeof(m_hdr)) {
+            capture_hdr_t hdr;
+            memcpy(&hdr, m_hdr, sizeof(hdr));
+            m_rec_type = hdr.type;
+            m_rec_left = hdr.len;
+            if (m_rec_left == 0) {
+                m_hdr_len = 0;
+            }
+        }
+        return 1;
+    }
+
+    if (m_rec_type == CAP_TX) {
+        if (nextExpected() != c) {
+            if (m_first_mismatch < 0) {
+                m_first_mismatch = m_tx_bytes;
+            }
+            m_tx_mismatches++;
+        }
+        m_tx_bytes++;
+    }
+    if (--m_rec_left == 0) {
+        m_hdr_len = 0;
+    }
+    return 1;
+}
+
+size_t ESP8266Replay::write(const uint8_t *buffer, size_t size)
+{
+    for (size_t i = 0; i < size; i++) {
+        write(buffer[i]);
+    }
+    return size;
+}
@@ -0,0 +1,122 @@
+/**
+ * @file ESP8266Replay.h
+ * @brief The definition of class ESP8266Replay.
+ *
+ * @par Copyright:
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version. \n\n
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef __ESP8266_REPLAY_H__
+#define __ESP8266_REPLAY_H__
+
+#include "ESP8266.h"
+
+/**
+ * Drive an ESP8266 with a capture of ESP8266::captureStart().
+ *
+ * Segments are queued and received bytes fed to the parser in capture
+ * order, with no waiting, and the bytes stateful_tx() writes are compared
+ * with the captured ones. Before each received chunk stateful_tx() runs
+ * until it stops writing, which is the order the pump thread gives. The
+ * ESP8266 must use the same CIPSEND chunk size as the captured one.
+ *
+ * Time follows the capture: while a replay exists it is the clock of the
+ * library (ESP8266Timer::setClock()) and moves to the time of each record
+ * before it is replayed, with the timers that expired by then handled
+ * first. Protocol timeouts so happen where they did when captured. One
+ * replay at a time, the default clock is back once it is destroyed.
+ */
+class ESP8266Replay : public Print {
+ public:
+    /*
+     * Constructor, takes over the capture sink of esp.
+     *
+     * @param esp - the object to drive, not pumped by a thread and with
+     *  nothing on its UART, step() runs its pump().
+     * @param capture - the capture, must outlive the replay (queued
+     *  segments point into it).
+     * @param len - bytes in capture.
+     */
+    ESP8266Replay(ESP8266 &esp, const uint8_t *capture, size_t len);
+    ~ESP8266Replay();
+
+    /**
+     * Get whether the capture starts with CAPTURE_MAGIC.
+     */
+    bool valid(void);
+
+    /**
+     * Replay the next record.
+     *
+     * @retval true - a record was replayed.
+     * @retval false - end of the capture.
+     */
+    bool step(void);
+
+    /**
+     * Replay the rest of the capture.
+     *
+     * @return the number of records replayed.
+     */
+    uint32_t run(void);
+
+    /**
+     * Get the number of bytes stateful_tx() wrote so far.
+     */
+    uint32_t getTxBytes(void);
+
+    /**
+     * Get the number of written bytes that differ from the capture,
+     * including bytes past its end.
+     */
+    uint32_t getTxMismatches(void);
+
+    /**
+     * Get the offset in the TX stream of the first difference, -1 if none.
+     */
+    int32_t getFirstMismatch(void);
+
+    /* Capture sink of the replayed object */
+    size_t write(uint8_t c);
+    size_t write(const uint8_t *buffer, size_t size);
+
+ private:
+    void drainTx(void);
+    int nextExpected(void);
+    void advance(uint32_t us);
+    static uint64_t clock(void);
+
+    static uint64_t s_now;  /* the time of the replay */
+    uint32_t m_last_us;     /* capture_hdr_t::us of the last record */
+
+    ESP8266 *m_esp;
+    const uint8_t *m_capture;
+    size_t m_len;
+    size_t m_pos;           /* next record to replay */
+
+    /* Walk over the captured TX bytes */
+    size_t m_exp_pos;       /* record holding the next expected byte */
+    uint16_t m_exp_off;
+
+    /* Parse the records written to the sink */
+    uint8_t m_hdr[sizeof(capture_hdr_t)];
+    uint8_t m_hdr_len;
+    uint8_t m_skip_magic;
+    uint8_t m_rec_type;
+    uint16_t m_rec_left;
+
+    uint32_t m_tx_bytes;
+    uint32_t m_tx_mismatches;
+    int32_t m_first_mismatch;
+};
+
+#endif /* #ifndef __ESP8266_REPLAY_H__ */
@@ -0,0 +1,393 @@
+/**
+ * @file ESP8266Sim.cpp
+ * @brief The implementation of class ESP8266Sim.
+ *
+ * @par Copyright:
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version. \n\n
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifdef ESP8266_HOST
+
+#include "ESP8266Sim.h"
+#include <chrono>
+
+#define SIM_BOOT_US     50000   /* AT+RST to "ready" */
+#define SIM_CHUNK_MAX   2048    /* CIPSEND limit */
+
+static const char *SIM_GMR =
+    "AT version:1.2.0.0(Jul  1 2016 20:04:45)\r\n"
+    "SDK version:2.0.0(656edbf)\r\n"
+    "compile time:Jul 19 2016 18:44:22\r\n";
+
+ESP8266Sim::ESP8266Sim(HostPipe *from_host, HostPipe *to_host, const sim_config_t *config)
+{
+    m_in = from_host;
+    m_out = to_host;
+    setConfig(config);
+
+    m_last_due = ESP8266Timer::nowUs();
+    m_link_free = m_last_due;
+    m_send_mux = -1;
+    m_send_left = 0;
+
+    m_echo = true;
+    m_mode = 1;
+    m_mux = 0;
+    m_server_port = 0;
+    m_joined = false;
+    for (int i = 0; i < MAX_MUX; i++) {
+        m_open[i] = false;
+    }
+
+    m_commands = 0;
+    m_chunks = 0;
+    m_busy = 0;
+    m_failed = 0;
+    m_run = false;
+}
+
+ESP8266Sim::~ESP8266Sim()
+{
+    stop();
+}
+
+void ESP8266Sim::setConfig(const sim_config_t *config)
+{
+    std::lock_guard<std::mutex> m(m_lock);
+    memset(&m_config, 0, sizeof(m_config));
+    m_config.frame_max = 1460;
+    if (config) {
+        m_config = *config;
+        if (m_config.frame_max == 0) {
+            m_config.frame_max = 1460;
+        }
+    }
+    m_rand = m_config.seed ? m_config.seed : 0x2545F491;
+}
+
+void ESP8266Sim::start(void)
+{
+    if (m_run) {
+        return;
+    }
+    m_run = true;
+    m_thread = std::thread([this] {
+        while (m_run) {
+            poll();
+            std::this_thread::sleep_for(std::chrono::microseconds(50));
+        }
+    });
+}
+
+void ESP8266Sim::stop(void)
+{
+    if (!m_run) {
+        return;
+    }
+    m_run = false;
+    m_thread.join();
+}
+
+void ESP8266Sim::poll(void)
+{
+    std::lock_guard<std::mutex> m(m_lock);
+    int c;
+
+    while ((c = m_in->pop()) >= 0) {
+        if (m_send_mux >= 0) {
+            m_send_data += (char)c;
+            if (--m_send_left > 0) {
+                continue;
+            }
+            uint8_t mux = m_send_mux;
+            m_send_mux = -1;
+            m_chunks++;
+
+            char buf[32];
+            snprintf(buf, sizeof(buf), "\r\nRecv %u bytes\r\n", (unsigned)m_send_data.size());
+            respond(buf);
+            if (!m_open[mux] || chance(m_config.loss_pct)) {
+                m_failed++;
+                respond("\r\nSEND FAIL\r\n", airtime(m_send_data.size()));
+            } else {
+                m_received[mux] += m_send_data;
+                respond("\r\nSEND OK\r\n", airtime(m_send_data.size()));
+            }
+            m_send_data.clear();
+            continue;
+        }
+
+        m_line += (char)c;
+        if (m_line.size() >= 2 && m_line.compare(m_line.size() - 2, 2, "\r\n") == 0) {
+            m_line.resize(m_line.size() - 2);
+            if (!m_line.empty()) {
+                command(m_line);
+            }
+            m_line.clear();
+        }
+    }
+
+    uint32_t now = ESP8266Timer::nowUs();
+    while (!m_queue.empty() && (int32_t)(now - m_queue.front().due) >= 0) {
+        const std::string &bytes = m_queue.front().bytes;
+        m_out->push((const uint8_t*)bytes.data(), bytes.size());
+        m_queue.pop_front();
+    }
+}
+
+bool ESP8266Sim::pending(void)
+{
+    std::lock_guard<std::mutex> m(m_lock);
+    return !m_queue.empty();
+}
+
+bool ESP8266Sim::connect(uint8_t mux_id)
+{
+    std::lock_guard<std::mutex> m(m_lock);
+    if (mux_id >= MAX_MUX || m_open[mux_id]) {
+        return false;
+    }
+    m_open[mux_id] = true;
+    respond(std::to_string(mux_id) + ",CONNECT\r\n");
+    return true;
+}
+
+bool ESP8266Sim::disconnect(uint8_t mux_id)
+{
+    std::lock_guard<std::mutex> m(m_lock);
+    if (mux_id >= MAX_MUX || !m_open[mux_id]) {
+        return false;
+    }
+    m_open[mux_id] = false;
+    respond(std::to_string(mux_id) + ",CLOSED\r\n");
+    return true;
+}
+
+bool ESP8266Sim::inject(uint8_t mux_id, const char *data, uint32_t len)
+{
+    std::lock_guard<std::mutex> m(m_lock);
+    if (mux_id >= MAX_MUX || !m_open[mux_id]) {
+        return false;
+    }
+    while (len > 0) {
+        uint32_t n = len < m_config.frame_max ? len : m_config.frame_max;
+        char hdr[32];
+        snprintf(hdr, sizeof(hdr), "\r\n+IPD,%u,%u:", mux_id, (unsigned)n);
+        respond(std::string(hdr) + std::string(data, n), airtime(n));
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+std::string ESP8266Sim::takeReceived(uint8_t mux_id)
+{
+    std::lock_guard<std::mutex> m(m_lock);
+    std::string ret;
+    if (mux_id < MAX_MUX) {
+        ret.swap(m_received[mux_id]);
+    }
+    return ret;
+}
+
+/*
+ * Queue bytes for the host. The UART keeps them in order, so nothing is
+ * delivered before what was queued earlier.
+ */
+void ESP8266Sim::respond(const std::string &bytes, uint32_t delay_us)
+{
+    uint32_t due = ESP8266Timer::nowUs() + m_config.latency_us + delay_us;
+    if ((int32_t)(due - m_last_due) < 0) {
+        due = m_last_due;
+    }
+    m_last_due = due;
+    m_queue.push_back({due, bytes});
+}
+
+void ESP8266Sim::reply(const std::string &line, const std::string &body, bool ok)
+{
+    respond((m_echo ? line + "\r\r\n" : "") + body + (ok ? "\r\nOK\r\n" : "\r\nERROR\r\n"));
+}
+
+/*
+ * Time the WiFi link needs for len bytes after what it already carries.
+ */
+uint32_t ESP8266Sim::airtime(uint32_t len)
+{
+    if (m_config.bandwidth == 0) {
+        return 0;
+    }
+    uint32_t now = ESP8266Timer::nowUs();
+    uint32_t start = (int32_t)(m_link_free - now) > 0 ? m_link_free : now;
+    m_link_free = start + (uint64_t)len * 1000000 / m_config.bandwidth;
+    return m_link_free - now;
+}
+
+bool ESP8266Sim::chance(uint8_t pct)
+{
+    if (pct == 0) {
+        return false;
+    }
+    m_rand ^= m_rand << 13;
+    m_rand ^= m_rand >> 17;
+    m_rand ^= m_rand << 5;
+    return m_rand % 100 < pct;
+}
+
+/* Argument n (0 based) of "AT+CMD=a,b,c" with quotes removed */
+static std::string arg(const std::string &line, int n)
+{
+    size_t at = line.find('=');
+    if (at == std::string::npos) {
+        return "";
+    }
+    at++;
+    for (int i = 0; i < n; i++) {
+        bool quoted = false;
+        while (at < line.size() && (quoted || line[at] != ',')) {
+            if (line[at] == '"') {
+                quoted = !quoted;
+            }
+            at++;
+        }
+        if (at++ >= line.size()) {
+            return "";
+        }
+    }
+    std::string ret;
+    bool quoted = false;
+    for (; at < line.size() && (quoted || line[at] != ','); at++) {
+        if (line[at] == '"') {
+            quoted = !quoted;
+        } else {
+            ret += line[at];
+        }
+    }
+    return ret;
+}
+
+void ESP8266Sim::command(const std::string &line)
+{
+    char buf[96];
+    m_commands++;
+
+    if (line == "AT") {
+        reply(line, "", true);
+    } else if (line == "ATE0" || line == "ATE1") {
+        /* Echoed or not as before, the new setting applies from the next command */
+        reply(line, "", true);
+        m_echo = line == "ATE1";
+    } else if (line == "AT+RST") {
+        reply(line, "", true);
+        m_echo = true;
+        m_mux = 0;
+        m_server_port = 0;
+        for (int i = 0; i < MAX_MUX; i++) {
+            m_open[i] = false;
+        }
+        respond("\r\n ets Jan  8 2013,rst cause:2, boot mode:(3,7)\r\n\r\nready\r\n", SIM_BOOT_US);
+    } else if (line == "AT+GMR") {
+        reply(line, SIM_GMR, true);
+    } else if (line == "AT+CWMODE?") {
+        snprintf(buf, sizeof(buf), "+CWMODE:%u\r\n", m_mode);
+        reply(line, buf, true);
+    } else if (line.compare(0, 10, "AT+CWMODE=") == 0) {
+        int mode = atoi(arg(line, 0).c_str());
+        bool ok = mode >= 1 && mode <= 3;
+        if (ok) {
+            m_mode = mode;
+        }
+        reply(line, "", ok);
+    } else if (line == "AT+CWJAP?") {
+        if (m_joined) {
+            snprintf(buf, sizeof(buf), "+CWJAP:\"%s\",\"18:fe:34:00:00:01\",6,-52\r\n", m_ssid.c_str());
+            reply(line, buf, true);
+        } else {
+            reply(line, "No AP\r\n", true);
+        }
+    } else if (line.compare(0, 9, "AT+CWJAP=") == 0) {
+        m_ssid = arg(line, 0);
+        m_joined = !m_ssid.empty();
+        reply(line, m_joined ? "WIFI CONNECTED\r\nWIFI GOT IP\r\n" : "+CWJAP:3\r\nFAIL\r\n", m_joined);
+    } else if (line == "AT+CIPMUX?") {
+        snprintf(buf, sizeof(buf), "+CIPMUX:%u\r\n", m_mux);
+        reply(line, buf, true);
+    } else if (line.compare(0, 10, "AT+CIPMUX=") == 0) {
+        if (m_server_port) {
+            reply(line, "link is builded\r\n", false);
+        } else {
+            m_mux = atoi(arg(line, 0).c_str()) ? 1 : 0;
+            reply(line, "", true);
+        }
+    } else if (line.compare(0, 13, "AT+CIPSERVER=") == 0) {
+        bool on = atoi(arg(line, 0).c_str()) != 0;
+        if (on && !m_mux) {
+            reply(line, "", false);
+        } else {
+            m_server_port = on ? atoi(arg(line, 1).c_str()) : 0;
+            if (on && m_server_port == 0) {
+                m_server_port = 333;
+            }
+            reply(line, on ? "" : "no change\r\n", true);
+        }
+    } else if (line.compare(0, 12, "AT+CIPSTART=") == 0) {
+        int mux = m_mux ? atoi(arg(line, 0).c_str()) : 0;
+        if (mux < 0 || mux >= MAX_MUX) {
+            reply(line, "", false);
+        } else if (m_open[mux]) {
+            reply(line, "ALREADY CONNECTED\r\n", false);
+        } else {
+            m_open[mux] = true;
+            snprintf(buf, sizeof(buf), m_mux ? "%d,CONNECT\r\n" : "CONNECT\r\n", mux);
+            reply(line, buf, true);
+        }
+    } else if (line.compare(0, 11, "AT+CIPCLOSE") == 0) {
+        int mux = line.size() > 11 ? atoi(arg(line, 0).c_str()) : 0;
+        if (mux < 0 || mux >= MAX_MUX || !m_open[mux]) {
+            reply(line, "", false);
+        } else {
+            m_open[mux] = false;
+            snprintf(buf, sizeof(buf), m_mux ? "%d,CLOSED\r\n" : "CLOSED\r\n", mux);
+            reply(line, buf, true);
+        }
+    } else if (line == "AT+CIPSTATUS") {
+        std::string body = m_joined ? "STATUS:3\r\n" : "STATUS:5\r\n";
+        for (int i = 0; i < MAX_MUX; i++) {
+            if (m_open[i]) {
+                snprintf(buf, sizeof(buf), "+CIPSTATUS:%d,\"TCP\",\"192.168.4.2\",%u,%d,1\r\n",
+                         i, m_server_port, 40000 + i);
+                body += buf;
+            }
+        }
+        reply(line, body, true);
+    } else if (line.compare(0, 11, "AT+CIPSEND=") == 0) {
+        int mux = m_mux ? atoi(arg(line, 0).c_str()) : 0;
+        long len = atol(arg(line, m_mux ? 1 : 0).c_str());
+        if (chance(m_config.busy_pct)) {
+            /* Not even echoed, the firmware is still on the last command */
+            m_busy++;
+            respond("busy p...\r\n");
+        } else if (mux < 0 || mux >= MAX_MUX || !m_open[mux]) {
+            reply(line, "link is not valid\r\n", false);
+        } else if (len <= 0 || len > SIM_CHUNK_MAX) {
+            reply(line, "", false);
+        } else {
+            respond((m_echo ? line + "\r\r\n" : "") + "\r\nOK\r\n> ");
+            m_send_mux = mux;
+            m_send_left = len;
+        }
+    } else {
+        reply(line, "", false);
+    }
+}
+
+#endif /* #ifdef ESP8266_HOST */
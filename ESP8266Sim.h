@@ -0,0 +1,152 @@
+/**
+ * @file ESP8266Sim.h
+ * @brief The definition of class ESP8266Sim.
+ *
+ * @par Copyright:
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version. \n\n
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef __ESP8266_SIM_H__
+#define __ESP8266_SIM_H__
+
+#ifdef ESP8266_HOST
+
+#include "ESP8266.h"
+#include <deque>
+#include <string>
+#include <thread>
+
+/*
+ * Behaviour of the simulated module.
+ */
+typedef struct {
+    uint32_t latency_us;    /* before every response */
+    uint32_t bandwidth;     /* bytes/s of the WiFi link, 0 unlimited */
+    uint16_t frame_max;     /* longest +IPD frame, the firmware uses 1460 */
+    uint8_t loss_pct;       /* chunks answered with SEND FAIL */
+    uint8_t busy_pct;       /* CIPSENDs answered with "busy p..." */
+    uint32_t seed;
+} sim_config_t;
+
+/**
+ * A local ESP8266 speaking the AT dialect the library uses.
+ *
+ * Sits on the far end of the HostPipes of a host HardwareSerial. Handles
+ * AT, ATE0/ATE1, RST, GMR, CWMODE, CWJAP, CIPMUX, CIPSERVER, CIPSTART,
+ * CIPSEND, CIPCLOSE and CIPSTATUS (queries included) and answers anything
+ * else with ERROR. The remote peers are driven with connect(), inject() and
+ * disconnect(); what the library sends them is kept per link.
+ *
+ * Either call poll() from the test loop, which is deterministic, or
+ * start() a thread that does.
+ */
+class ESP8266Sim {
+ public:
+    /*
+     * Constructor.
+     *
+     * @param from_host - the pipe the library writes to.
+     * @param to_host - the pipe the library reads from.
+     * @param config - behaviour, NULL for an ideal module.
+     */
+    ESP8266Sim(HostPipe *from_host, HostPipe *to_host, const sim_config_t *config = NULL);
+    ~ESP8266Sim();
+
+    void setConfig(const sim_config_t *config);
+
+    /**
+     * Handle the commands written so far and deliver the responses that
+     * are due.
+     */
+    void poll(void);
+    void start(void);
+    void stop(void);
+
+    /**
+     * Open a link from a remote peer, "<mux_id>,CONNECT".
+     */
+    bool connect(uint8_t mux_id);
+
+    /**
+     * Close a link from the remote side, "<mux_id>,CLOSED".
+     */
+    bool disconnect(uint8_t mux_id);
+
+    /**
+     * Send data from the remote peer, split into +IPD frames of at most
+     * frame_max bytes and paced by the bandwidth.
+     */
+    bool inject(uint8_t mux_id, const char *data, uint32_t len);
+
+    /**
+     * Take what the library sent to the remote peer of a link.
+     */
+    std::string takeReceived(uint8_t mux_id);
+
+    /**
+     * Get whether responses are still waiting for their time.
+     */
+    bool pending(void);
+
+    uint32_t getCommands(void) { return m_commands; }
+    uint32_t getChunks(void) { return m_chunks; }
+    uint32_t getBusy(void) { return m_busy; }
+    uint32_t getFailed(void) { return m_failed; }
+
+ private:
+    void command(const std::string &line);
+    void respond(const std::string &bytes, uint32_t delay_us = 0);
+    void reply(const std::string &line, const std::string &body, bool ok);
+    uint32_t airtime(uint32_t len);
+    bool chance(uint8_t pct);
+
+    struct out_t {
+        uint32_t due;           /* ESP8266Timer::nowUs() */
+        std::string bytes;
+    };
+
+    HostPipe *m_in;
+    HostPipe *m_out;
+    sim_config_t m_config;
+    uint32_t m_rand;
+
+    std::mutex m_lock;
+    std::deque<out_t> m_queue;
+    uint32_t m_last_due;
+    uint32_t m_link_free;
+
+    std::string m_line;
+    int m_send_mux;         /* -1 in command mode */
+    uint32_t m_send_left;
+    std::string m_send_data;
+
+    bool m_echo;            /* ATE1, the default */
+    uint8_t m_mode;
+    uint8_t m_mux;
+    uint16_t m_server_port;
+    bool m_joined;
+    std::string m_ssid;
+    bool m_open[MAX_MUX];
+    std::string m_received[MAX_MUX];
+
+    uint32_t m_commands;
+    uint32_t m_chunks;
+    uint32_t m_busy;
+    uint32_t m_failed;
+
+    volatile bool m_run;
+    std::thread m_thread;
+};
+
+#endif /* #ifdef ESP8266_HOST */
+
+#endif /* #ifndef __ESP8266_SIM_H__ */
@@ -0,0 +1,138 @@
+/**
+ * @file ESP8266Timer.cpp
+ * @brief The implementation of class ESP8266Timer.
+ *
+ * @par Copyright:
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version. \n\n
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include "ESP8266Timer.h"
+
+esp8266_clock_t volatile ESP8266Timer::s_clock = NULL;
+
+void ESP8266Timer::setClock(esp8266_clock_t clock)
+{
+    s_clock = clock;
+}
+
+uint32_t ESP8266Timer::nowMs(void)
+{
+    esp8266_clock_t clock = s_clock;
+    return clock ? (uint32_t)(clock() / 1000) : millis();
+}
+
+uint32_t ESP8266Timer::nowUs(void)
+{
+    esp8266_clock_t clock = s_clock;
+    return clock ? (uint32_t)clock() : micros();
+}
+
+#ifdef ESP8266_HOST
+static uint64_t g_virtual_us;
+
+static uint64_t virtual_clock(void)
+{
+    return __atomic_load_n(&g_virtual_us, __ATOMIC_ACQUIRE);
+}
+
+void ESP8266Timer::useVirtualClock(uint64_t start_us)
+{
+    __atomic_store_n(&g_virtual_us, start_us, __ATOMIC_RELEASE);
+    setClock(virtual_clock);
+}
+
+void ESP8266Timer::advanceClock(uint64_t us)
+{
+    __atomic_fetch_add(&g_virtual_us, us, __ATOMIC_RELEASE);
+}
+#endif
+
+ESP8266Timer::ESP8266Timer()
+{
+    m_tick = nowMs();
+    for (uint16_t i = 0; i < ESP8266_TIMER_SLOTS; i++) {
+        m_slot[i] = NULL;
+    }
+}
+
+void ESP8266Timer::unlink(timer_node_t *t)
+{
+    *t->link = t->next;
+    if (t->next) {
+        t->next->link = t->link;
+    }
+    t->next = NULL;
+    t->link = NULL;
+}
+
+void ESP8266Timer::arm(timer_node_t *t, uint32_t timeout)
+{
+    Threads::Scope m(m_lock);
+    if (t->link) {
+        unlink(t);
+    }
+    t->expires = nowMs() + (timeout ? timeout : 1);
+
+    timer_node_t **slot = &m_slot[t->expires % ESP8266_TIMER_SLOTS];
+    t->next = *slot;
+    if (t->next) {
+        t->next->link = &t->next;
+    }
+    t->link = slot;
+    *slot = t;
+}
+
+void ESP8266Timer::cancel(timer_node_t *t)
+{
+    /* Idle timers are the common case, skip the lock for them */
+    if (__atomic_load_n(&t->link, __ATOMIC_RELAXED) == NULL) {
+        return;
+    }
+    Threads::Scope m(m_lock);
+    if (t->link) {
+        unlink(t);
+    }
+}
+
+bool ESP8266Timer::armed(timer_node_t *t)
+{
+    return __atomic_load_n(&t->link, __ATOMIC_RELAXED) != NULL;
+}
+
+uint32_t ESP8266Timer::poll(void)
+{
+    uint32_t fired = 0;
+    Threads::Scope m(m_lock);
+    uint32_t now = nowMs();
+    uint32_t ticks = now - m_tick;
+    if (ticks == 0) {
+        return 0;
+    }
+    /* After a long gap every slot is visited once */
+    if (ticks > ESP8266_TIMER_SLOTS) {
+        ticks = ESP8266_TIMER_SLOTS;
+    }
+
+    for (uint32_t tick = now - ticks + 1; tick != now + 1; tick++) {
+        timer_node_t *t = m_slot[tick % ESP8266_TIMER_SLOTS];
+        while (t) {
+            timer_node_t *next = t->next;
+            if ((int32_t)(now - t->expires) >= 0) {
+                unlink(t);
+                fired |= 1UL << t->id;
+            }
+            t = next;
+        }
+    }
+    m_tick = now;
+    return fired;
+}
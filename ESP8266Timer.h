@@ -0,0 +1,100 @@
+/**
+ * @file ESP8266Timer.h
+ * @brief The definition of class ESP8266Timer.
+ *
+ * @par Copyright:
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version. \n\n
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef __ESP8266_TIMER_H__
+#define __ESP8266_TIMER_H__
+
+#include "ESP8266_hal.h"
+#include "ESP8266_config.h"
+
+/*
+ * A monotonic clock in microseconds. 64 bits, so it doesn't wrap and the
+ * millisecond clock derived from it wraps at 2^32 like millis() does.
+ */
+typedef uint64_t (*esp8266_clock_t)(void);
+
+/*
+ * A timer, owned by the caller. Idle when link is NULL.
+ */
+typedef struct timer_node {
+    struct timer_node *next;
+    struct timer_node **link;   /* the pointer to this node in its slot */
+    uint32_t expires;           /* ESP8266Timer::nowMs() */
+    uint8_t id;                 /* bit reported by poll(), 0 - 31 */
+} timer_node_t;
+
+/**
+ * The clock of the library and a timer wheel for protocol deadlines.
+ *
+ * Every timeout of the library reads nowMs()/nowUs(). They are millis()
+ * and micros() until setClock() installs another clock, e.g. a virtual
+ * one a test advances instead of sleeping.
+ *
+ * The wheel has ESP8266_TIMER_SLOTS slots of one millisecond, a timer
+ * sits in the slot of its expiry and is checked each time poll() passes
+ * it, so arm(), cancel() and poll() are O(1) per timer and per tick no
+ * matter how far ahead the deadline is.
+ */
+class ESP8266Timer {
+ public:
+    /**
+     * Install the clock of the library.
+     *
+     * @param clock - microseconds, NULL restores millis()/micros().
+     */
+    static void setClock(esp8266_clock_t clock);
+    static uint32_t nowMs(void);
+    static uint32_t nowUs(void);
+
+#ifdef ESP8266_HOST
+    /**
+     * Switch to a virtual clock, only advanceClock() moves it.
+     */
+    static void useVirtualClock(uint64_t start_us = 0);
+    static void advanceClock(uint64_t us);
+#endif
+
+    ESP8266Timer();
+
+    /**
+     * Arm a timer, re-arming it if it is armed.
+     *
+     * @param t - the timer.
+     * @param timeout - milliseconds from now, at least 1.
+     */
+    void arm(timer_node_t *t, uint32_t timeout);
+    void cancel(timer_node_t *t);
+    bool armed(timer_node_t *t);
+
+    /**
+     * Advance to now and disarm the timers that expired.
+     *
+     * @return the bits (1 << id) of the timers that expired.
+     */
+    uint32_t poll(void);
+
+ private:
+    static esp8266_clock_t volatile s_clock;
+
+    void unlink(timer_node_t *t);
+
+    Threads::Mutex m_lock;  /* leaf, taken with the engine locks held */
+    uint32_t m_tick;        /* last ms poll() visited */
+    timer_node_t *m_slot[ESP8266_TIMER_SLOTS];
+};
+
+#endif /* #ifndef __ESP8266_TIMER_H__ */
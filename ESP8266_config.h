@@ -0,0 +1,129 @@
+/**
+ * @file ESP8266_config.h
+ * @brief Compile time sizing of class ESP8266.
+ *
+ * Every value can be overridden from the build flags (e.g. PlatformIO
+ * build_flags = -DESP8266_RX_CAPACITY=2048) so a low memory sensor build
+ * and a high throughput gateway build share the same sources. The RAM
+ * taken by one ESP8266 object is checked against ESP8266_RAM_BUDGET at
+ * compile time, the message arena (ESP8266_MSG_SLOTS * ESP8266_MSG_CAPACITY)
+ * is static and shared by all objects.
+ *
+ *  - sensor:  -DESP8266_MAX_MUX=1 -DESP8266_RX_CAPACITY=512 -DESP8266_MSG_CAPACITY=512
+ *             -DESP8266_MSG_SLOTS=1 -DESP8266_PARSER_BUF=600 -DESP8266_RAM_BUDGET=3072
+ *  - gateway: -DESP8266_RX_CAPACITY=4096 -DESP8266_PARSER_BUF=1536
+ *             -DESP8266_TX_QUEUE_DEPTH=8 -DESP8266_RAM_BUDGET=32768
+ */
+#ifndef __ESP8266_CONFIG_H__
+#define __ESP8266_CONFIG_H__
+
+/* Links, the AT firmware has 5 */
+#ifndef ESP8266_MAX_MUX
+#define ESP8266_MAX_MUX 5
+#endif
+
+/* Received bytes buffered per link, power of two */
+#ifndef ESP8266_RX_CAPACITY
+#define ESP8266_RX_CAPACITY 1024
+#endif
+
+/* Longest request returned by super_recv_mux_done */
+#ifndef ESP8266_MSG_CAPACITY
+#define ESP8266_MSG_CAPACITY 1024
+#endif
+
+/* Messages in the arena of recvTake(), shared by all instances */
+#ifndef ESP8266_MSG_SLOTS
+#define ESP8266_MSG_SLOTS 4
+#endif
+
+/* Longest line the parser holds, +IPD frame data bypasses it and goes
+ * straight to the RX ring of the link */
+#ifndef ESP8266_PARSER_BUF
+#define ESP8266_PARSER_BUF 1024
+#endif
+
+/* Segments queued per link, power of two */
+#ifndef ESP8266_TX_QUEUE_DEPTH
+#define ESP8266_TX_QUEUE_DEPTH 4
+#endif
+
+/* CIPSEND chunk until probeCapabilities() allows ESP8266_TX_CHUNK_MAX */
+#ifndef ESP8266_TX_CHUNK_LEN
+#define ESP8266_TX_CHUNK_LEN 512
+#endif
+
+#ifndef ESP8266_TX_CHUNK_MAX
+#define ESP8266_TX_CHUNK_MAX 2048
+#endif
+
+/* Binary trace records kept, power of two, 0 compiles tracing out */
+#ifndef ESP8266_TRACE_DEPTH
+#define ESP8266_TRACE_DEPTH 128
+#endif
+
+/*
+ * Diagnostics on Console compiled in: 0 none, 1 errors, 2 warnings,
+ * 3 info, 4 debug (every prompt, chunk and status line).
+ */
+#ifndef ESP8266_LOG_LEVEL
+#define ESP8266_LOG_LEVEL 2
+#endif
+
+/* Prefix each diagnostic with file, line and function */
+#ifndef ESP8266_LOG_PREFIX
+#define ESP8266_LOG_PREFIX 0
+#endif
+
+/* Slots of one millisecond in the timer wheel, power of two */
+#ifndef ESP8266_TIMER_SLOTS
+#define ESP8266_TIMER_SLOTS 16
+#endif
+
+/* Milliseconds the parser may sit in one line or +IPD frame */
+#ifndef ESP8266_RX_STALL_MS
+#define ESP8266_RX_STALL_MS 2000
+#endif
+
+/* Milliseconds from AT+CIPSEND to the "> " prompt, and held after a miss */
+#ifndef ESP8266_TX_PROMPT_MS
+#define ESP8266_TX_PROMPT_MS 1000
+#endif
+
+/* Milliseconds from the end of a chunk to SEND OK/FAIL */
+#ifndef ESP8266_TX_RESULT_MS
+#define ESP8266_TX_RESULT_MS 5000
+#endif
+
+/* Upper bound of sizeof(ESP8266) */
+#ifndef ESP8266_RAM_BUDGET
+#define ESP8266_RAM_BUDGET 12288
+#endif
+
+static_assert(ESP8266_MAX_MUX >= 1 && ESP8266_MAX_MUX <= 5,
+              "ESP8266_MAX_MUX must be 1 - 5");
+static_assert(ESP8266_RX_CAPACITY >= 64 && ESP8266_RX_CAPACITY <= 32768
+              && (ESP8266_RX_CAPACITY & (ESP8266_RX_CAPACITY - 1)) == 0,
+              "ESP8266_RX_CAPACITY must be a power of two, 64 - 32768");
+static_assert(ESP8266_MSG_CAPACITY >= 64 && ESP8266_MSG_CAPACITY <= 0xFFFF,
+              "ESP8266_MSG_CAPACITY must be 64 - 65535");
+static_assert(ESP8266_MSG_SLOTS >= 1 && ESP8266_MSG_SLOTS <= 32,
+              "ESP8266_MSG_SLOTS must be 1 - 32");
+static_assert(ESP8266_PARSER_BUF >= 64 && ESP8266_PARSER_BUF <= 0xFFFF,
+              "ESP8266_PARSER_BUF must be 64 - 65535");
+static_assert(ESP8266_TX_QUEUE_DEPTH >= 1 && ESP8266_TX_QUEUE_DEPTH <= 128
+              && (ESP8266_TX_QUEUE_DEPTH & (ESP8266_TX_QUEUE_DEPTH - 1)) == 0,
+              "ESP8266_TX_QUEUE_DEPTH must be a power of two, 1 - 128");
+static_assert(ESP8266_TRACE_DEPTH <= 4096
+              && (ESP8266_TRACE_DEPTH & (ESP8266_TRACE_DEPTH - 1)) == 0,
+              "ESP8266_TRACE_DEPTH must be 0 or a power of two up to 4096");
+static_assert(ESP8266_TX_CHUNK_LEN >= 1 && ESP8266_TX_CHUNK_LEN <= ESP8266_TX_CHUNK_MAX
+              && ESP8266_TX_CHUNK_MAX <= 2048,
+              "ESP8266_TX_CHUNK_LEN <= ESP8266_TX_CHUNK_MAX <= 2048 (CIPSEND limit)");
+static_assert(ESP8266_TIMER_SLOTS >= 1 && ESP8266_TIMER_SLOTS <= 1024
+              && (ESP8266_TIMER_SLOTS & (ESP8266_TIMER_SLOTS - 1)) == 0,
+              "ESP8266_TIMER_SLOTS must be a power of two, 1 - 1024");
+static_assert(ESP8266_RX_STALL_MS >= 1 && ESP8266_TX_PROMPT_MS >= 1 && ESP8266_TX_RESULT_MS >= 1,
+              "ESP8266 timeouts must be at least 1 ms");
+
+#endif /* #ifndef __ESP8266_CONFIG_H__ */
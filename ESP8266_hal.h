@@ -0,0 +1,22 @@
+/**
+ * @file ESP8266_hal.h
+ * @brief Platform layer of class ESP8266.
+ *
+ * The library uses the Arduino String/Stream/HardwareSerial interfaces,
+ * millis()/micros()/delay(), TeensyThreads and a Console Print. On the
+ * Teensy they come from the core, TeensyThreads and the application's
+ * console.h. Building with -DESP8266_HOST takes them from ESP8266_host.h
+ * instead, so the RX, TX and command engines run unmodified on Linux.
+ */
+#ifndef __ESP8266_HAL_H__
+#define __ESP8266_HAL_H__
+
+#ifdef ESP8266_HOST
+#include "ESP8266_host.h"
+#else
+#include "Arduino.h"
+#include "TeensyThreads.h"
+#include <console.h>
+#endif
+
+#endif /* #ifndef __ESP8266_HAL_H__ */
@@ -0,0 +1,380 @@
+/**
+ * @file ESP8266_host.cpp
+ * @brief Linux implementation of the platform layer of class ESP8266.
+ *
+ * @par Copyright:
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version. \n\n
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifdef ESP8266_HOST
+
+#include "ESP8266_host.h"
+
+#include <stdarg.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <chrono>
+#include <map>
+#include <thread>
+
+HostConsole Console;
+Threads threads;
+
+static const std::chrono::steady_clock::time_point g_start = std::chrono::steady_clock::now();
+
+unsigned long millis(void)
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - g_start).count();
+}
+
+unsigned long micros(void)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - g_start).count();
+}
+
+void delay(unsigned long ms)
+{
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+void delayMicroseconds(unsigned int us)
+{
+    std::this_thread::sleep_for(std::chrono::microseconds(us));
+}
+
+/* Print */
+
+size_t Print::write(const uint8_t *buffer, size_t size)
+{
+    size_t n = 0;
+    while (size--) {
+        n += write(*buffer++);
+    }
+    return n;
+}
+
+size_t Print::print(long n)
+{
+    char buf[24];
+    return write((const uint8_t*)buf, snprintf(buf, sizeof(buf), "%ld", n));
+}
+
+size_t Print::print(unsigned long n)
+{
+    char buf[24];
+    return write((const uint8_t*)buf, snprintf(buf, sizeof(buf), "%lu", n));
+}
+
+int Print::printf(const char *format, ...)
+{
+    char buf[256];
+    va_list ap;
+    va_start(ap, format);
+    int n = vsnprintf(buf, sizeof(buf), format, ap);
+    va_end(ap);
+    if (n < 0) {
+        return n;
+    }
+    if ((size_t)n >= sizeof(buf)) {
+        n = sizeof(buf) - 1;
+    }
+    return write((const uint8_t*)buf, n);
+}
+
+size_t Stream::readBytes(char *buffer, size_t length)
+{
+    size_t count = 0;
+    unsigned long start = millis();
+    while (count < length) {
+        int c = read();
+        if (c < 0) {
+            if (millis() - start >= m_timeout) {
+                break;
+            }
+            std::this_thread::yield();
+            continue;
+        }
+        buffer[count++] = (char)c;
+    }
+    return count;
+}
+
+/* HostPipe */
+
+void HostPipe::push(const uint8_t *data, size_t len)
+{
+    std::lock_guard<std::mutex> m(m_lock);
+    m_bytes.insert(m_bytes.end(), data, data + len);
+}
+
+int HostPipe::pop(void)
+{
+    std::lock_guard<std::mutex> m(m_lock);
+    if (m_bytes.empty()) {
+        return -1;
+    }
+    int c = m_bytes.front();
+    m_bytes.pop_front();
+    return c;
+}
+
+int HostPipe::peek(void)
+{
+    std::lock_guard<std::mutex> m(m_lock);
+    return m_bytes.empty() ? -1 : m_bytes.front();
+}
+
+size_t HostPipe::size(void)
+{
+    std::lock_guard<std::mutex> m(m_lock);
+    return m_bytes.size();
+}
+
+void HostPipe::clear(void)
+{
+    std::lock_guard<std::mutex> m(m_lock);
+    m_bytes.clear();
+}
+
+/* HardwareSerial */
+
+HardwareSerial::~HardwareSerial()
+{
+    close();
+}
+
+void HardwareSerial::attach(HostPipe *rx, HostPipe *tx)
+{
+    close();
+    m_rx = rx;
+    m_tx = tx;
+}
+
+static bool make_raw(int fd)
+{
+    struct termios tio;
+    if (tcgetattr(fd, &tio) < 0) {
+        return false;
+    }
+    cfmakeraw(&tio);
+    return tcsetattr(fd, TCSANOW, &tio) == 0;
+}
+
+bool HardwareSerial::open(const char *path)
+{
+    close();
+    m_fd = ::open(path, O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (m_fd < 0) {
+        return false;
+    }
+    make_raw(m_fd);
+    return true;
+}
+
+bool HardwareSerial::openPty(char *name, size_t size)
+{
+    close();
+    m_fd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (m_fd < 0) {
+        return false;
+    }
+    if (grantpt(m_fd) < 0 || unlockpt(m_fd) < 0 || ptsname_r(m_fd, name, size) != 0) {
+        close();
+        return false;
+    }
+    make_raw(m_fd);
+    return true;
+}
+
+void HardwareSerial::close(void)
+{
+    if (m_fd >= 0) {
+        ::close(m_fd);
+    }
+    m_fd = -1;
+    m_rx = NULL;
+    m_tx = NULL;
+    m_peeked = -1;
+}
+
+static speed_t baud_speed(uint32_t baud)
+{
+    switch (baud) {
+        case 9600:      return B9600;
+        case 19200:     return B19200;
+        case 38400:     return B38400;
+        case 57600:     return B57600;
+        case 230400:    return B230400;
+        case 460800:    return B460800;
+        case 921600:    return B921600;
+        case 115200:
+        default:        return B115200;
+    }
+}
+
+void HardwareSerial::begin(uint32_t baud)
+{
+    m_baud = baud;
+    if (m_fd >= 0) {
+        struct termios tio;
+        if (tcgetattr(m_fd, &tio) == 0) {
+            cfsetispeed(&tio, baud_speed(baud));
+            cfsetospeed(&tio, baud_speed(baud));
+            tcsetattr(m_fd, TCSANOW, &tio);
+        }
+    }
+}
+
+int HardwareSerial::available(void)
+{
+    int n = (m_peeked >= 0) ? 1 : 0;
+    if (m_rx) {
+        return n + m_rx->size();
+    }
+    if (m_fd >= 0) {
+        int pending = 0;
+        if (ioctl(m_fd, FIONREAD, &pending) == 0) {
+            n += pending;
+        }
+    }
+    return n;
+}
+
+int HardwareSerial::read(void)
+{
+    if (m_peeked >= 0) {
+        int c = m_peeked;
+        m_peeked = -1;
+        return c;
+    }
+    if (m_rx) {
+        return m_rx->pop();
+    }
+    uint8_t c;
+    if (m_fd >= 0 && ::read(m_fd, &c, 1) == 1) {
+        return c;
+    }
+    return -1;
+}
+
+int HardwareSerial::peek(void)
+{
+    if (m_peeked < 0) {
+        if (m_rx) {
+            return m_rx->peek();
+        }
+        m_peeked = read();
+    }
+    return m_peeked;
+}
+
+size_t HardwareSerial::write(const uint8_t *buffer, size_t size)
+{
+    if (m_tx) {
+        m_tx->push(buffer, size);
+    } else if (m_fd >= 0) {
+        size_t done = 0;
+        while (done < size) {
+            ssize_t n = ::write(m_fd, buffer + done, size - done);
+            if (n > 0) {
+                done += n;
+            } else {
+                std::this_thread::yield();
+            }
+        }
+    }
+    return size;
+}
+
+/* Threads */
+
+static std::mutex g_threads_lock;
+static std::map<int, std::thread> g_threads;
+static int g_thread_next = 1;
+
+int Threads::addThread(ThreadFunction p, void *arg, int stack_size, void *stack)
+{
+    (void)stack_size;
+    (void)stack;
+    std::lock_guard<std::mutex> m(g_threads_lock);
+    int id = g_thread_next++;
+    g_threads[id] = std::thread(p, arg);
+    return id;
+}
+
+int Threads::wait(int id, unsigned int timeout_ms)
+{
+    /* Joins, the host threads all end when asked to */
+    (void)timeout_ms;
+    std::thread t;
+    {
+        std::lock_guard<std::mutex> m(g_threads_lock);
+        auto it = g_threads.find(id);
+        if (it == g_threads.end()) {
+            return -1;
+        }
+        t = std::move(it->second);
+        g_threads.erase(it);
+    }
+    t.join();
+    return id;
+}
+
+int Threads::id(void)
+{
+    return (int)(std::hash<std::thread::id>()(std::this_thread::get_id()) & 0x7FFFFFFF);
+}
+
+void Threads::yield(void)
+{
+    std::this_thread::yield();
+}
+
+void Threads::delay(int ms)
+{
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+int Threads::Mutex::getState(void)
+{
+    if (m_mutex.try_lock()) {
+        m_mutex.unlock();
+        return 0;
+    }
+    return 1;
+}
+
+int Threads::Mutex::lock(unsigned int timeout_ms)
+{
+    if (timeout_ms == 0) {
+        m_mutex.lock();
+        return 1;
+    }
+    return m_mutex.try_lock_for(std::chrono::milliseconds(timeout_ms)) ? 1 : 0;
+}
+
+int Threads::Mutex::try_lock(void)
+{
+    return m_mutex.try_lock() ? 1 : 0;
+}
+
+int Threads::Mutex::unlock(void)
+{
+    m_mutex.unlock();
+    return 1;
+}
+
+#endif /* #ifdef ESP8266_HOST */
@@ -0,0 +1,260 @@
+/**
+ * @file ESP8266_host.h
+ * @brief Linux implementation of the platform layer of class ESP8266.
+ *
+ * Provides the part of the Arduino, Teensy core and TeensyThreads
+ * interfaces the library uses: String, Print/Stream, a HardwareSerial
+ * backed by an in-memory pipe or a tty/pty, millis()/micros() on the
+ * steady clock, Threads on std::thread/std::mutex and a Console on
+ * stdout. Selected by ESP8266_HOST, see ESP8266_hal.h.
+ *
+ * @par Copyright:
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version. \n\n
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef __ESP8266_HOST_H__
+#define __ESP8266_HOST_H__
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <deque>
+#include <mutex>
+#include <string>
+
+typedef bool boolean;
+
+#define OUTPUT  1
+#define INPUT   0
+#define HIGH    1
+#define LOW     0
+
+unsigned long millis(void);
+unsigned long micros(void);
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+static inline void pinMode(uint8_t, uint8_t) {}
+static inline void digitalWrite(uint8_t, uint8_t) {}
+
+class String {
+ public:
+    String() {}
+    String(const char *c) : s(c ? c : "") {}
+    String(const std::string &c) : s(c) {}
+    String(char c) : s(1, c) {}
+    String(int v) : s(std::to_string(v)) {}
+    String(unsigned int v) : s(std::to_string(v)) {}
+    String(long v) : s(std::to_string(v)) {}
+    String(unsigned long v) : s(std::to_string(v)) {}
+
+    unsigned int length(void) const { return s.size(); }
+    const char *c_str(void) const { return s.c_str(); }
+    long toInt(void) const { return atol(s.c_str()); }
+    char charAt(unsigned int i) const { return i < s.size() ? s[i] : 0; }
+    char operator[](unsigned int i) const { return charAt(i); }
+    void reserve(unsigned int n) { s.reserve(n); }
+
+    int indexOf(char c, unsigned int from = 0) const { return pos(s.find(c, from)); }
+    int indexOf(const String &o, unsigned int from = 0) const { return pos(s.find(o.s, from)); }
+    String substring(unsigned int from) const {
+        return from < s.size() ? String(s.substr(from)) : String();
+    }
+    String substring(unsigned int from, unsigned int to) const {
+        return from < to && from < s.size() ? String(s.substr(from, to - from)) : String();
+    }
+    bool startsWith(const String &o) const { return s.compare(0, o.s.size(), o.s) == 0; }
+    bool endsWith(const String &o) const {
+        return s.size() >= o.s.size() && s.compare(s.size() - o.s.size(), o.s.size(), o.s) == 0;
+    }
+    bool equals(const String &o) const { return s == o.s; }
+    void trim(void) {
+        size_t a = s.find_first_not_of(" \t\r\n");
+        size_t b = s.find_last_not_of(" \t\r\n");
+        s = (a == std::string::npos) ? std::string() : s.substr(a, b - a + 1);
+    }
+    void toCharArray(char *buf, unsigned int n) const {
+        if (n) {
+            strncpy(buf, s.c_str(), n - 1);
+            buf[n - 1] = '\0';
+        }
+    }
+
+    String &operator+=(const String &o) { s += o.s; return *this; }
+    String &operator+=(const char *o) { s += o; return *this; }
+    String &operator+=(char c) { s += c; return *this; }
+    bool operator==(const String &o) const { return s == o.s; }
+    bool operator==(const char *o) const { return s == o; }
+    bool operator!=(const String &o) const { return s != o.s; }
+
+ private:
+    static int pos(size_t p) { return p == std::string::npos ? -1 : (int)p; }
+    std::string s;
+};
+
+static inline String operator+(const String &a, const String &b) { String r(a); r += b; return r; }
+static inline String operator+(const String &a, const char *b) { String r(a); r += b; return r; }
+static inline String operator+(const String &a, char b) { String r(a); r += b; return r; }
+
+class Print {
+ public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t c) = 0;
+    virtual size_t write(const uint8_t *buffer, size_t size);
+    size_t write(const char *str) { return write((const uint8_t*)str, strlen(str)); }
+    virtual int availableForWrite(void) { return 0; }
+    virtual void flush(void) {}
+
+    size_t print(const String &s) { return write(s.c_str()); }
+    size_t print(const char *s) { return write(s); }
+    size_t print(char c) { return write((uint8_t)c); }
+    size_t print(unsigned char n) { return print((unsigned long)n); }
+    size_t print(int n) { return print((long)n); }
+    size_t print(unsigned int n) { return print((unsigned long)n); }
+    size_t print(long n);
+    size_t print(unsigned long n);
+
+    template <typename T> size_t println(T v) { size_t n = print(v); return n + println(); }
+    size_t println(void) { return write("\r\n"); }
+
+    int printf(const char *format, ...) __attribute__((format(printf, 2, 3)));
+};
+
+class Stream : public Print {
+ public:
+    virtual int available(void) = 0;
+    virtual int read(void) = 0;
+    virtual int peek(void) = 0;
+    void setTimeout(unsigned long timeout) { m_timeout = timeout; }
+    size_t readBytes(char *buffer, size_t length);
+
+ protected:
+    unsigned long m_timeout = 1000;
+};
+
+/**
+ * One direction of an in-memory serial line.
+ */
+class HostPipe {
+ public:
+    void push(const uint8_t *data, size_t len);
+    int pop(void);
+    int peek(void);
+    size_t size(void);
+    void clear(void);
+
+ private:
+    std::mutex m_lock;
+    std::deque<uint8_t> m_bytes;
+};
+
+/**
+ * Serial port of the host: either the ends of two HostPipes or a tty/pty
+ * file descriptor. Unconnected, writes are dropped and nothing is read.
+ */
+class HardwareSerial : public Stream {
+ public:
+    HardwareSerial() : m_rx(NULL), m_tx(NULL), m_fd(-1), m_baud(0) {}
+    ~HardwareSerial();
+
+    /**
+     * Read from rx and write to tx, the other side uses them crosswise.
+     */
+    void attach(HostPipe *rx, HostPipe *tx);
+
+    /**
+     * Open a tty, e.g. an ESP8266 on a USB adapter or a pty slave.
+     */
+    bool open(const char *path);
+
+    /**
+     * Create a pty and use its master side.
+     *
+     * @param name - set to the slave device another program opens.
+     * @param size - room in name.
+     */
+    bool openPty(char *name, size_t size);
+    void close(void);
+
+    void begin(uint32_t baud);
+    void begin(uint32_t baud, uint32_t /* format */) { begin(baud); }
+    void end(void) {}
+    uint32_t getBaud(void) { return m_baud; }
+    bool attachRts(uint8_t /* pin */) { return true; }
+    bool attachCts(uint8_t /* pin */) { return true; }
+
+    int available(void);
+    int read(void);
+    int peek(void);
+    size_t write(uint8_t c) { return write(&c, 1); }
+    size_t write(const uint8_t *buffer, size_t size);
+    using Print::write;
+    int availableForWrite(void) { return 4096; }
+
+ private:
+    HostPipe *m_rx;
+    HostPipe *m_tx;
+    int m_fd;
+    int m_peeked = -1;
+    uint32_t m_baud;
+};
+
+/**
+ * Print on stdout.
+ */
+class HostConsole : public Print {
+ public:
+    size_t write(uint8_t c) { return fwrite(&c, 1, 1, stdout); }
+    size_t write(const uint8_t *buffer, size_t size) { return fwrite(buffer, 1, size, stdout); }
+    using Print::write;
+    void flush(void) { fflush(stdout); }
+};
+
+extern HostConsole Console;
+
+/**
+ * TeensyThreads on std::thread. Time slices don't apply, the host
+ * scheduler preempts.
+ */
+class Threads {
+ public:
+    typedef void (*ThreadFunction)(void*);
+
+    int addThread(ThreadFunction p, void *arg = 0, int stack_size = -1, void *stack = 0);
+    int wait(int id, unsigned int timeout_ms = 0);
+    int setTimeSlice(int /* id */, unsigned int /* ticks */) { return 1; }
+    int id(void);
+    void yield(void);
+    void delay(int ms);
+
+    class Mutex {
+     public:
+        int getState(void);
+        int lock(unsigned int timeout_ms = 0);
+        int try_lock(void);
+        int unlock(void);
+     private:
+        std::timed_mutex m_mutex;
+    };
+
+    class Scope {
+     public:
+        Scope(Mutex &m) : r(m) { r.lock(); }
+        ~Scope() { r.unlock(); }
+     private:
+        Mutex &r;
+    };
+};
+
+extern Threads threads;
+
+#endif /* #ifndef __ESP8266_HOST_H__ */
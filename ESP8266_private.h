@@ -1,7 +1,7 @@
 #ifndef ESP8266_PRIVATE
 #define ESP8266_PRIVATE
 
-#define MAX_MUX 5
+#define MAX_MUX ESP8266_MAX_MUX
 
 typedef enum {
     NEW_CMD = 0,
@@ -21,26 +21,49 @@ typedef enum {
 } tx_state_t;
 
 typedef struct {
-    char buf[1024];
+    char buf[ESP8266_PARSER_BUF];
     uint16_t iter;
     uint16_t ipd_length = 0;
+    uint16_t ipd_got = 0;           /* data bytes of the frame consumed so far */
     uint8_t ipd_mux    = 0;
     uint8_t  ipd_mux_term_index = 0;
-    uint8_t  ipd_header_length = 0;
+    bool ipd_drop = false;          /* frame didn't fit, consume and discard */
     recv_state_t state;
-    recv_msg_t msg;
+    volatile uint32_t rx_event;     /* an IPD frame reached a connection */
 } recv_ctx_t;
-recv_ctx_t ctx;
+
+/*
+ * Parser findings for the TX state machine, posted with __atomic_fetch_or
+ * by the RX path and collected with __atomic_exchange_n by the TX path.
+ */
+#define TX_EV_PROMPT        (1 << 0)    /* "> "                  */
+#define TX_EV_SEND_OK       (1 << 1)    /* "SEND OK"             */
+#define TX_EV_SEND_FAIL     (1 << 2)    /* "SEND FAIL"           */
+#define TX_EV_BUSY          (1 << 3)    /* "busy p..."           */
+#define TX_EV_CIPSEND_OK    (1 << 4)    /* AT+CIPSEND accepted   */
+#define TX_EV_CIPSEND_FAIL  (1 << 5)    /* AT+CIPSEND refused    */
+#define TX_EV_LINK_INVALID  (1 << 6)    /* "link is not valid"   */
+
+/*
+ * An AT+CIPSEND as the module echoes it back, ties a reply to the request.
+ * Never 0, the length of a chunk isn't.
+ */
+#define TX_TAG(mux, len)    (((uint32_t)(mux) << 16) | (uint16_t)(len))
 
 typedef struct {
     tx_state_t state;
     uint16_t requested_tx_len;
-    uint16_t wrote;
-    uint32_t last_write;
+    uint32_t last_write;            /* micros() of the AT+CIPSEND */
+    volatile uint32_t prompt_us;    /* micros() of the "> ", set with TX_EV_PROMPT */
+    volatile uint32_t result_us;    /* micros() of SEND OK/FAIL or busy */
     uint8_t mux_id;
+    uint8_t last_mux;   /* round robin, kept across reset_tx_ctx */
     bool failed;
-    Threads::Mutex lock;
+    volatile uint8_t events;
+    volatile uint32_t echo;         /* TX_TAG() of the AT+CIPSEND a setup finding answers, 0 untagged */
+    uint32_t held;                  /* TX_TAG() of a CIPSEND that timed out, 0 if none */
     char reason[32];
+    volatile uint32_t tx_event;     /* a segment left a connection */
+    volatile uint32_t idle_event;   /* parser or TX went back to idle */
 } tx_ctx_t;
-tx_ctx_t ctx_tx;
 #endif
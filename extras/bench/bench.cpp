@@ -0,0 +1,284 @@
+/**
+ * @file bench.cpp
+ * @brief Throughput and latency benchmarks of the RX/TX engines.
+ *
+ * Runs on the host platform layer against ESP8266Sim and prints one JSON
+ * object per line, e.g. for tracking results between releases:
+ *
+ *   g++ -std=gnu++11 -O2 -DESP8266_HOST -I. ESP8266*.cpp extras/bench/bench.cpp \
+ *       -lpthread -o esp8266_bench
+ *   ./esp8266_bench > bench.jsonl
+ *
+ * @par Copyright:
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version. \n\n
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include "ESP8266.h"
+#include "ESP8266Sim.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+static double now_s(void)
+{
+    return std::chrono::duration<double>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/* A request of len bytes ending in the HTTP terminator */
+static std::string request(uint32_t len)
+{
+    std::string r = "GET / HTTP/1.1\r\n";
+    while (r.size() + 4 < len) {
+        r += 'x';
+    }
+    return r + "\r\n\r\n";
+}
+
+/*
+ * An ESP8266 wired to a simulator, brought up as a server with links open.
+ */
+struct Rig {
+    HostPipe to_sim;
+    HostPipe to_esp;
+    HardwareSerial uart;
+    ESP8266Sim sim;
+    ESP8266 esp;
+
+    Rig(const sim_config_t *config, uint8_t links)
+        : sim(&to_sim, &to_esp, config), esp((uart.attach(&to_esp, &to_sim), uart), 115200, -1)
+    {
+        sim.start();
+        esp.restart();
+        esp.probeCapabilities();
+        esp.enableMUX();
+        esp.startTCPServer(80);
+        for (uint8_t i = 0; i < links; i++) {
+            sim.connect(i);
+        }
+        while (sim.pending()) {
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+        sim.stop();
+        while (uart.available()) {
+            esp.super_recv();
+        }
+    }
+
+    /* Single threaded pump, deterministic */
+    void step(void)
+    {
+        sim.poll();
+        esp.pump();
+    }
+};
+
+static void bench_parser(uint32_t frame)
+{
+    Rig rig(NULL, 1);
+    std::string req = request(frame);
+    char hdr[32];
+    std::string stream;
+    snprintf(hdr, sizeof(hdr), "\r\n+IPD,0,%u:", (unsigned)req.size());
+    for (int i = 0; i < 64; i++) {
+        stream += hdr + req;
+    }
+
+    recv_msg_t msg;
+    uint64_t bytes = 0;
+    uint32_t requests = 0;
+    double start = now_s();
+    double elapsed;
+    do {
+        /* One frame at a time, the RX ring holds ESP8266_RX_CAPACITY */
+        size_t per = stream.size() / 64;
+        for (size_t at = 0; at < stream.size(); at += per) {
+            rig.esp.feed(stream.data() + at, per);
+            while (rig.esp.super_recv_mux_done(&msg)) {
+                requests++;
+            }
+        }
+        bytes += stream.size();
+        elapsed = now_s() - start;
+    } while (elapsed < 0.5);
+
+    counters_t c;
+    rig.esp.getCounters(&c);
+    printf("{\"bench\":\"parser\",\"frame\":%u,\"bytes_per_s\":%.0f,\"requests\":%u,"
+           "\"dropped\":%u,\"parser_resets\":%u}\n",
+           (unsigned)req.size(), bytes / elapsed, requests,
+           c.mux[0].frames_dropped, c.parser_resets);
+}
+
+static void bench_extract(uint32_t len)
+{
+    Rig rig(NULL, 1);
+    std::string req = request(len);
+    /* As many requests as one frame can carry into the RX ring */
+    uint32_t room = ESP8266_RX_CAPACITY < ESP8266_PARSER_BUF ? ESP8266_RX_CAPACITY : ESP8266_PARSER_BUF;
+    uint32_t per_fill = (room - 32) / req.size();
+    std::string all;
+    for (uint32_t i = 0; i < per_fill; i++) {
+        all += req;
+    }
+    char hdr[32];
+    snprintf(hdr, sizeof(hdr), "\r\n+IPD,0,%u:", (unsigned)all.size());
+    std::string frame = hdr + all;
+
+    recv_msg_t msg;
+    uint64_t requests = 0;
+    double busy = 0;
+    double start = now_s();
+    while (now_s() - start < 0.5) {
+        rig.esp.feed(frame.data(), frame.size());
+        double t = now_s();
+        while (rig.esp.super_recv_mux_done(&msg)) {
+            requests++;
+        }
+        busy += now_s() - t;
+    }
+    printf("{\"bench\":\"extract\",\"request\":%u,\"requests_per_s\":%.0f}\n",
+           (unsigned)req.size(), requests / busy);
+}
+
+static void bench_goodput(uint16_t chunk, uint32_t bandwidth)
+{
+    sim_config_t config = {0, bandwidth, 1460, 0, 0, 1};
+    Rig rig(&config, 1);
+    static uint8_t segment[8192];
+    memset(segment, 'y', sizeof(segment));
+    rig.esp.setTxChunk(chunk);
+
+    uint64_t bytes = 0;
+    double start = now_s();
+    double elapsed;
+    do {
+        while (rig.esp.queueAvail(0)) {
+            rig.esp.queue(0, segment, sizeof(segment));
+        }
+        rig.step();
+        bytes += rig.sim.takeReceived(0).size();
+        elapsed = now_s() - start;
+    } while (elapsed < 1.0);
+
+    printf("{\"bench\":\"goodput\",\"chunk\":%u,\"bandwidth\":%u,\"bytes_per_s\":%.0f,"
+           "\"p50_prompt_us\":%u,\"p50_send_us\":%u}\n",
+           chunk, bandwidth, bytes / elapsed,
+           rig.esp.getLatency(LAT_PROMPT, 50), rig.esp.getLatency(LAT_SEND, 50));
+}
+
+/*
+ * Every link has the same backlog, Jain's index of what each got through
+ * when the first one finished (1.0 is perfectly fair).
+ */
+static void bench_fairness(void)
+{
+    Rig rig(NULL, MAX_MUX);
+    static uint8_t segment[4096];
+    memset(segment, 'z', sizeof(segment));
+    uint64_t sent[MAX_MUX] = {0};
+
+    for (uint8_t i = 0; i < MAX_MUX; i++) {
+        for (int k = 0; k < TX_QUEUE_DEPTH; k++) {
+            rig.esp.queue(i, segment, sizeof(segment));
+        }
+    }
+    bool done = false;
+    while (!done) {
+        rig.step();
+        for (uint8_t i = 0; i < MAX_MUX; i++) {
+            sent[i] += rig.sim.takeReceived(i).size();
+            if (rig.esp.getQueued(i) == 0) {
+                done = true;
+            }
+        }
+    }
+
+    double sum = 0, sq = 0;
+    for (uint8_t i = 0; i < MAX_MUX; i++) {
+        sum += sent[i];
+        sq += (double)sent[i] * sent[i];
+    }
+    printf("{\"bench\":\"fairness\",\"links\":%u,\"jain\":%.4f,\"bytes\":%.0f}\n",
+           MAX_MUX, sq ? sum * sum / (MAX_MUX * sq) : 1.0, sum);
+}
+
+/*
+ * runCommand() round trips while the pump thread moves data both ways.
+ */
+static void bench_command(void)
+{
+    sim_config_t config = {100, 2000000, 1460, 0, 0, 1};
+    Rig rig(&config, 2);
+    static uint8_t segment[4096];
+    memset(segment, 'c', sizeof(segment));
+    std::string req = request(256);
+
+    rig.sim.start();
+    rig.esp.start();
+    std::atomic<bool> run(true);
+    std::thread load([&] {
+        recv_msg_t msg;
+        while (run) {
+            if (rig.esp.queueAvail(0)) {
+                rig.esp.queue(0, segment, sizeof(segment));
+            }
+            rig.sim.takeReceived(0);
+            rig.sim.inject(1, req.data(), req.size());
+            while (rig.esp.super_recv_mux_done(&msg)) {
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    });
+
+    std::vector<double> us;
+    for (int i = 0; i < 200; i++) {
+        double t = now_s();
+        rig.esp.runCommand("AT");
+        us.push_back((now_s() - t) * 1e6);
+    }
+    run = false;
+    load.join();
+    rig.esp.stop();
+    rig.sim.stop();
+
+    std::sort(us.begin(), us.end());
+    printf("{\"bench\":\"command\",\"runs\":%u,\"p50_us\":%.0f,\"p99_us\":%.0f,\"max_us\":%.0f}\n",
+           (unsigned)us.size(), us[us.size() / 2], us[us.size() * 99 / 100], us.back());
+}
+
+int main(void)
+{
+    const uint32_t frames[] = {64, 256, 512, 900};
+    for (uint32_t frame : frames) {
+        bench_parser(frame);
+    }
+
+    const uint32_t requests[] = {64, 256, 768};
+    for (uint32_t len : requests) {
+        bench_extract(len);
+    }
+
+    const uint16_t chunks[] = {128, 256, 512, 1024, 2048};
+    for (uint16_t chunk : chunks) {
+        bench_goodput(chunk, 0);
+        bench_goodput(chunk, 1000000);
+    }
+
+    bench_fairness();
+    bench_command();
+    return 0;
+}
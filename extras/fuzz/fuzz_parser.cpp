@@ -0,0 +1,138 @@
+/**
+ * @file fuzz_parser.cpp
+ * @brief A fuzz target of the RX parser and the TX feedback it posts.
+ *
+ * Every input is a byte stream from the module. It is fed to a fresh
+ * ESP8266 in pieces, with a segment queued on every link so the TX state
+ * machine has prompts and results to act on, and the bounds of the parser
+ * buffer and the rings are checked after each piece. The virtual clock
+ * moves on between pieces so the protocol timeouts fire too.
+ *
+ *   clang++ -std=gnu++11 -g -O1 -fsanitize=fuzzer,address,undefined -DESP8266_HOST -I. \
+ *       ESP8266*.cpp extras/fuzz/fuzz_parser.cpp -lpthread -o esp8266_fuzz
+ *   ./esp8266_fuzz extras/fuzz/corpus
+ *
+ * Without libFuzzer, e.g. for AFL or to time the corpus as a regression
+ * set of the parser, build with -DFUZZ_STANDALONE and give it files:
+ *
+ *   g++ -std=gnu++11 -O2 -DESP8266_HOST -DFUZZ_STANDALONE -I. \
+ *       ESP8266*.cpp extras/fuzz/fuzz_parser.cpp -lpthread -o esp8266_fuzz
+ *   ./esp8266_fuzz extras/fuzz/corpus/<file> ...
+ *
+ * The corpus was recorded from ESP8266Sim with extras/fuzz/make_corpus.cpp.
+ *
+ * @par Copyright:
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version. \n\n
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include "ESP8266.h"
+#include "fuzz_rig.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define FUZZ_PIECE_MAX  64          /* bytes fed per step, like a UART read */
+#define FUZZ_STEP_US    10000       /* virtual time per step, a timeout takes 100 */
+#define FUZZ_TX_RUNS    4           /* the pump loops a few times per line */
+
+static counters_t g_counters;      /* of the last input */
+
+static void check(ESP8266 *esp)
+{
+    const char *broken = esp->checkInvariants();
+    if (broken) {
+        fprintf(stderr, "invariant: %s\n", broken);
+        abort();
+    }
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    static bool once = false;
+    if (!once) {
+        ESP8266Timer::useVirtualClock(1000000);
+        once = true;
+    }
+    if (size == 0) {
+        return 0;
+    }
+
+    /* What the library writes to the module goes nowhere */
+    HostPipe from_esp, to_esp;
+    HardwareSerial uart;
+    uart.attach(&to_esp, &from_esp);
+    ESP8266 esp(uart, 115200, -1);
+
+    fuzz_queue(&esp);
+
+    /*
+     * The first byte picks how the stream is cut, the rest is the stream.
+     * A piece also ends after a line or a "> ", TX only starts a CIPSEND
+     * with the parser between lines.
+     */
+    size_t piece = 1 + data[0] % FUZZ_PIECE_MAX;
+    recv_msg_t msg;
+    for (size_t at = 1, len; at < size; at += len) {
+        for (len = 1; len < piece && at + len < size; len++) {
+            uint8_t c = data[at + len - 1];
+            if (c == '\n' || (c == ' ' && len >= 2 && data[at + len - 2] == '>')) {
+                break;
+            }
+        }
+        esp.feed((const char*)data + at, len);
+        check(&esp);
+
+        /* Finishing a chunk and starting the next CIPSEND take a run each */
+        for (int k = 0; k < FUZZ_TX_RUNS; k++) {
+            esp.stateful_tx();
+        }
+        while (esp.super_recv_mux_done(&msg)) {
+        }
+        check(&esp);
+
+        ESP8266Timer::advanceClock(FUZZ_STEP_US);
+        esp.pump();
+        from_esp.clear();
+        check(&esp);
+    }
+    esp.getCounters(&g_counters);
+    return 0;
+}
+
+#ifdef FUZZ_STANDALONE
+int main(int argc, char **argv)
+{
+    static uint8_t buf[1 << 20];
+    for (int i = 1; i < argc; i++) {
+        FILE *f = fopen(argv[i], "rb");
+        if (!f) {
+            fprintf(stderr, "%s: can't open\n", argv[i]);
+            return 1;
+        }
+        size_t n = fread(buf, 1, sizeof(buf), f);
+        fclose(f);
+        LLVMFuzzerTestOneInput(buf, n);
+
+        /* What the input reached, e.g. that a seed still gets its chunks through */
+        uint32_t send_ok = 0, busy = 0, timeouts = 0;
+        for (uint8_t k = 0; k < MAX_MUX; k++) {
+            send_ok += g_counters.mux[k].send_ok;
+            busy += g_counters.mux[k].busy;
+            timeouts += g_counters.mux[k].timeouts;
+        }
+        printf("%s: %u bytes, send_ok %u busy %u timeouts %u unexpected %u malformed %u\n",
+               argv[i], (unsigned)n, send_ok, busy, timeouts,
+               g_counters.tx_unexpected, g_counters.malformed);
+    }
+    return 0;
+}
+#endif
@@ -0,0 +1,38 @@
+/**
+ * @file fuzz_rig.h
+ * @brief What fuzz_parser.cpp and make_corpus.cpp set up alike.
+ *
+ * The corpus is recorded with the TX queues the fuzz target starts with,
+ * so the CIPSENDs echoed in a seed are the ones the target makes.
+ *
+ * @par Copyright:
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version. \n\n
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#ifndef __FUZZ_RIG_H__
+#define __FUZZ_RIG_H__
+
+#include "ESP8266.h"
+
+#define FUZZ_SEGMENT_LEN 600    /* a full chunk and a short one */
+
+/* One segment on every link, the TX engine starts with link 1 */
+static inline void fuzz_queue(ESP8266 *esp)
+{
+    static uint8_t segment[FUZZ_SEGMENT_LEN];
+    memset(segment, 's', sizeof(segment));
+    for (uint8_t mux_id = 0; mux_id < MAX_MUX; mux_id++) {
+        esp->queue(mux_id, segment, sizeof(segment));
+    }
+}
+
+#endif /* #ifndef __FUZZ_RIG_H__ */
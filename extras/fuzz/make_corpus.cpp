@@ -0,0 +1,197 @@
+/**
+ * @file make_corpus.cpp
+ * @brief Records the seed corpus of fuzz_parser.cpp from ESP8266Sim.
+ *
+ * Runs a few sessions against the simulator and writes what super_recv()
+ * read from the UART in each, as captured by ESP8266::captureStart(), to
+ * one file per session with the piece byte of the fuzz target in front.
+ * The sessions queue what the fuzz target queues, see fuzz_rig.h:
+ *
+ *   g++ -std=gnu++11 -O2 -DESP8266_HOST -I. ESP8266*.cpp extras/fuzz/make_corpus.cpp \
+ *       -lpthread -o esp8266_corpus
+ *   ./esp8266_corpus extras/fuzz/corpus
+ *
+ * @par Copyright:
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version. \n\n
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#include "ESP8266.h"
+#include "ESP8266Sim.h"
+#include "fuzz_rig.h"
+
+#include <string>
+
+/* Keeps the capture in memory */
+class Recorder : public Print {
+ public:
+    std::string bytes;
+
+    size_t write(uint8_t c)
+    {
+        bytes += (char)c;
+        return 1;
+    }
+
+    size_t write(const uint8_t *buffer, size_t size)
+    {
+        bytes.append((const char*)buffer, size);
+        return size;
+    }
+
+    /* The payloads of the CAP_RX records, in order */
+    std::string rx(void)
+    {
+        std::string out;
+        size_t at = 4;
+        while (at + sizeof(capture_hdr_t) <= bytes.size()) {
+            capture_hdr_t hdr;
+            memcpy(&hdr, bytes.data() + at, sizeof(hdr));
+            at += sizeof(hdr);
+            if (hdr.type == CAP_RX) {
+                out.append(bytes, at, hdr.len);
+            }
+            at += hdr.len;
+        }
+        return out;
+    }
+};
+
+/*
+ * An ESP8266 wired to a simulator, a server with links open, stepped from
+ * one thread like the fuzz target.
+ */
+struct Session {
+    HostPipe to_sim;
+    HostPipe to_esp;
+    HardwareSerial uart;
+    ESP8266Sim sim;
+    ESP8266 esp;
+    Recorder rec;
+
+    Session(const sim_config_t *config, uint8_t links)
+        : sim(&to_sim, &to_esp, config), esp((uart.attach(&to_esp, &to_sim), uart), 115200, -1)
+    {
+        sim.start();
+        esp.restart();
+        esp.enableMUX();
+        esp.startTCPServer(80);
+        sim.stop();
+        while (uart.available()) {
+            esp.super_recv();
+        }
+        esp.captureStart(&rec);
+        for (uint8_t i = 0; i < links; i++) {
+            sim.connect(i);
+        }
+        run(50);
+        fuzz_queue(&esp);
+    }
+
+    void run(int steps)
+    {
+        recv_msg_t msg;
+        for (int i = 0; i < steps; i++) {
+            sim.poll();
+            esp.pump();
+            while (esp.super_recv_mux_done(&msg)) {
+            }
+            for (uint8_t k = 0; k < MAX_MUX; k++) {
+                sim.takeReceived(k);
+            }
+        }
+    }
+
+    bool save(const char *dir, const char *name, uint8_t piece)
+    {
+        esp.captureStop();
+        std::string path = std::string(dir) + "/" + name;
+        FILE *f = fopen(path.c_str(), "wb");
+        if (!f) {
+            return false;
+        }
+        std::string stream = rec.rx();
+        fputc(piece, f);
+        fwrite(stream.data(), 1, stream.size(), f);
+        fclose(f);
+        printf("%s: %u bytes\n", path.c_str(), (unsigned)stream.size() + 1);
+        return true;
+    }
+};
+
+static std::string request(uint32_t len)
+{
+    std::string r = "GET / HTTP/1.1\r\n";
+    while (r.size() + 4 < len) {
+        r += 'x';
+    }
+    return r + "\r\n\r\n";
+}
+
+/* Requests on two links, some larger than a frame, the other segments fail */
+static bool rx_requests(const char *dir)
+{
+    sim_config_t config = {0, 0, 256, 0, 0, 1};
+    Session s(&config, 2);
+    const uint32_t lens[] = {40, 200, 700, 64};
+    for (uint32_t len : lens) {
+        std::string req = request(len);
+        s.sim.inject(0, req.data(), req.size());
+        s.sim.inject(1, req.data(), req.size());
+        s.run(20);
+    }
+    return s.save(dir, "rx_requests", 63);
+}
+
+/* The segments of every link through, prompts and SEND OK */
+static bool tx_segments(const char *dir)
+{
+    Session s(NULL, MAX_MUX);
+    s.run(200);
+    return s.save(dir, "tx_segments", 15);
+}
+
+/* The module busy or losing chunks now and then */
+static bool tx_faults(const char *dir)
+{
+    sim_config_t config = {0, 0, 1460, 25, 25, 7};
+    Session s(&config, MAX_MUX);
+    s.run(300);
+    return s.save(dir, "tx_faults", 31);
+}
+
+/* Requests in while segments go out, then the links close */
+static bool mixed(const char *dir)
+{
+    Session s(NULL, 3);
+    std::string req = request(120);
+    for (int round = 0; round < 3; round++) {
+        for (uint8_t i = 0; i < 3; i++) {
+            s.sim.inject(i, req.data(), req.size());
+        }
+        s.run(10);
+    }
+    for (uint8_t i = 0; i < 3; i++) {
+        s.sim.disconnect(i);
+    }
+    s.run(20);
+    return s.save(dir, "mixed", 47);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <corpus dir>\n", argv[0]);
+        return 1;
+    }
+    bool ok = rx_requests(argv[1]) && tx_segments(argv[1]) && tx_faults(argv[1]) && mixed(argv[1]);
+    return ok ? 0 : 1;
+}
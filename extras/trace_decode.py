@@ -0,0 +1,57 @@
+#!/usr/bin/env python3
+"""
+Decode a trace written by ESP8266::traceDump().
+
+    trace_decode.py dump.bin
+
+The dump is "E8TR", uint16 record count, uint16 record size, then the
+records oldest first, little endian:
+
+    uint32 us, uint16 len, uint8 event, uint8 info (mux << 4 | state)
+"""
+import struct
+import sys
+
+EVENTS = {
+    0x01: "RX_STATE", 0x02: "RX_IPD", 0x03: "RX_DROP", 0x04: "RX_RESET",
+    0x05: "RX_PROMPT", 0x06: "RX_SEND_OK", 0x07: "RX_SEND_FAIL",
+    0x08: "RX_BUSY", 0x09: "RX_CIPSEND_OK", 0x0A: "RX_CIPSEND_FAIL",
+    0x0B: "RX_LINK_INVALID", 0x0C: "RX_CONNECT", 0x0D: "RX_CLOSED",
+    0x0E: "RX_MALFORMED", 0x0F: "RX_STALL",
+    0x20: "TX_STATE", 0x21: "TX_CIPSEND", 0x22: "TX_DATA",
+    0x23: "TX_CHUNK_OK", 0x24: "TX_CHUNK_FAIL", 0x25: "TX_RETRY",
+    0x26: "TX_SEGMENT", 0x27: "TX_TIMEOUT",
+    0x28: "TX_UNEXPECTED",
+}
+
+RX_STATES = ["NEW_CMD", "STATUS", "IPD_STATUS", "IPD_MUX", "IPD_LENGTH", "IPD_FRAME"]
+TX_STATES = ["READY", "WAIT_FOR_TRANSMISSION", "WAIT_FOR_TRANSMISSION_RESULT",
+             "TRANSMISSION_COMPLETE", "TRANSMIT"]
+
+
+def decode(data):
+    if data[:4] != b"E8TR":
+        raise ValueError("not a trace dump")
+    count, size = struct.unpack_from("<HH", data, 4)
+    first = None
+    for i in range(count):
+        us, length, event, info = struct.unpack_from("<IHBB", data, 8 + i * size)
+        if first is None:
+            first = us
+        states = TX_STATES if event & 0x20 else RX_STATES
+        state = info & 0x0F
+        yield "%10u %-16s mux %u len %5u %s" % (
+            (us - first) & 0xFFFFFFFF, EVENTS.get(event, "0x%02x" % event),
+            info >> 4, length, states[state] if state < len(states) else state)
+
+
+def main():
+    if len(sys.argv) != 2:
+        sys.exit(__doc__)
+    with open(sys.argv[1], "rb") as f:
+        for line in decode(f.read()):
+            print(line)
+
+
+if __name__ == "__main__":
+    main()